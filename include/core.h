@@ -44,5 +44,8 @@
 /// Compile-time static assertion
 #define STATIC_ASSERT(a, b)  _Static_assert(a, b)
 
+/// Align a structure or variable to a CPU cache line boundary
+#define CACHEALIGN           __attribute__((aligned(64)))
+
 /// Forced structure packing (use only when absolutely necessary)
 #define PACKSTRUCT           __attribute__((packed, aligned(1)))
@@ -41,3 +41,20 @@ timer_enable();
 //----------------------------------------------------------------------------
 void
 timer_disable();
+
+//----------------------------------------------------------------------------
+//  @function   timer_frequency
+/// @brief      Return the frequency of timer interrupts.
+/// @returns    The interrupt frequency in Hz, or 0 if the timer hasn't been
+///             initialized.
+//----------------------------------------------------------------------------
+uint32_t
+timer_frequency();
+
+//----------------------------------------------------------------------------
+//  @function   timer_ticks
+/// @brief      Return the number of timer interrupts since initialization.
+/// @returns    The tick count.
+//----------------------------------------------------------------------------
+uint64_t
+timer_ticks();
@@ -10,6 +10,7 @@
 #pragma once
 
 #include <core.h>
+#include <kernel/interrupt/interrupt.h>
 
 // CPU exception constants
 #define EXCEPTION_DIVBYZERO            0x00
@@ -40,3 +41,14 @@
 //----------------------------------------------------------------------------
 void
 exceptions_init();
+
+//----------------------------------------------------------------------------
+//  @function   exception_fatal
+/// @brief      Report an exception that could not be handled and hang the
+///             system.
+/// @details    Exception handlers installed by other modules call this
+///             when they can't resolve the exception.
+/// @param[in]  context     The CPU state at the time of the exception.
+//----------------------------------------------------------------------------
+void
+exception_fatal(const interrupt_context_t *context);
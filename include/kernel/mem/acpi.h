@@ -189,6 +189,102 @@ struct acpi_madt_iso
     uint16_t flags;           ///< MPS INTI flags
 } PACKSTRUCT;
 
+//----------------------------------------------------------------------------
+//  @struct     acpi_srat
+/// @brief      System Resource Affinity Table (SRAT).
+//----------------------------------------------------------------------------
+struct acpi_srat
+{
+    struct acpi_hdr hdr;
+
+    uint32_t reserved1;        ///< Must be 1 for backward compatibility
+    uint64_t reserved2;
+} PACKSTRUCT;
+
+//----------------------------------------------------------------------------
+//  @enum       acpi_srat_type
+/// @brief      SRAT entry types.
+//----------------------------------------------------------------------------
+enum acpi_srat_type
+{
+    ACPI_SRAT_LOCAL_APIC   = 0,  ///< Processor Local APIC affinity
+    ACPI_SRAT_MEMORY       = 1,  ///< Memory affinity
+    ACPI_SRAT_LOCAL_X2APIC = 2,  ///< Processor Local x2APIC affinity
+};
+
+//----------------------------------------------------------------------------
+//  @struct     acpi_srat_hdr
+/// @brief      SRAT entry header.
+//----------------------------------------------------------------------------
+struct acpi_srat_hdr
+{
+    uint8_t type;           ///< acpi_srat_type
+    uint8_t length;         ///< Length of the entry including header
+} PACKSTRUCT;
+
+//----------------------------------------------------------------------------
+//  @struct     acpi_srat_local_apic
+/// @brief      SRAT processor local APIC affinity entry
+//----------------------------------------------------------------------------
+struct acpi_srat_local_apic
+{
+    struct acpi_srat_hdr hdr; // type = 0
+
+    uint8_t  domain_lo;       ///< Proximity domain bits [7:0]
+    uint8_t  apicid;          ///< Local APIC ID
+    uint32_t flags;           ///< Affinity flags (bit 0 = enabled)
+    uint8_t  sapic_eid;       ///< Local SAPIC EID
+    uint8_t  domain_hi[3];    ///< Proximity domain bits [31:8]
+    uint32_t clock_domain;    ///< Clock domain
+} PACKSTRUCT;
+
+//----------------------------------------------------------------------------
+//  @struct     acpi_srat_memory
+/// @brief      SRAT memory affinity entry
+//----------------------------------------------------------------------------
+struct acpi_srat_memory
+{
+    struct acpi_srat_hdr hdr; // type = 1
+
+    uint32_t domain;          ///< Proximity domain
+    uint16_t reserved1;
+    uint64_t base;            ///< Base address of the memory range
+    uint64_t length;          ///< Length of the memory range
+    uint32_t reserved2;
+    uint32_t flags;           ///< Affinity flags (bit 0 = enabled)
+    uint64_t reserved3;
+} PACKSTRUCT;
+
+//----------------------------------------------------------------------------
+//  @struct     acpi_srat_local_x2apic
+/// @brief      SRAT processor local x2APIC affinity entry
+//----------------------------------------------------------------------------
+struct acpi_srat_local_x2apic
+{
+    struct acpi_srat_hdr hdr; // type = 2
+
+    uint16_t reserved1;
+    uint32_t domain;          ///< Proximity domain
+    uint32_t x2apicid;        ///< Local x2APIC ID
+    uint32_t flags;           ///< Affinity flags (bit 0 = enabled)
+    uint32_t clock_domain;    ///< Clock domain
+    uint32_t reserved2;
+} PACKSTRUCT;
+
+//----------------------------------------------------------------------------
+//  @struct     acpi_slit
+/// @brief      System Locality Information Table (SLIT).
+/// @details    The table is followed by a localities x localities matrix
+///             of byte-sized relative distances between proximity domains.
+//----------------------------------------------------------------------------
+struct acpi_slit
+{
+    struct acpi_hdr hdr;
+
+    uint64_t localities;       ///< Number of system localities
+    uint8_t  distance[1];      ///< Distance matrix (localities^2 entries)
+} PACKSTRUCT;
+
 //----------------------------------------------------------------------------
 //  @function   acpi_init
 /// @brief      Find and parse all available ACPI tables.
@@ -221,6 +317,15 @@ acpi_fadt();
 const struct acpi_madt *
 acpi_madt();
 
+//----------------------------------------------------------------------------
+//  @function   acpi_slit
+/// @brief      Return a pointer to the ACPI system locality information
+///             table (SLIT).
+/// @returns    A pointer to the SLIT structure, or NULL if not present.
+//----------------------------------------------------------------------------
+const struct acpi_slit *
+acpi_slit();
+
 //----------------------------------------------------------------------------
 //  @function   acpi_next_local_apic
 /// @brief      Return a pointer to the next Local APIC structure entry in
@@ -266,3 +371,36 @@ acpi_next_iso(const struct acpi_madt_iso *prev);
 //----------------------------------------------------------------------------
 const struct acpi_mcfg_addr *
 acpi_next_mcfg_addr(const struct acpi_mcfg_addr *prev);
+
+//----------------------------------------------------------------------------
+//  @function   acpi_next_srat_local_apic
+/// @brief      Return a pointer to the next processor local APIC affinity
+///             entry in the SRAT table.
+/// @param[in]  prev    Pointer to the entry returned by a previous call to
+///                     this function. Pass NULL for the first call.
+/// @returns    A pointer to the next entry, or NULL if none remain.
+//----------------------------------------------------------------------------
+const struct acpi_srat_local_apic *
+acpi_next_srat_local_apic(const struct acpi_srat_local_apic *prev);
+
+//----------------------------------------------------------------------------
+//  @function   acpi_next_srat_local_x2apic
+/// @brief      Return a pointer to the next processor local x2APIC affinity
+///             entry in the SRAT table.
+/// @param[in]  prev    Pointer to the entry returned by a previous call to
+///                     this function. Pass NULL for the first call.
+/// @returns    A pointer to the next entry, or NULL if none remain.
+//----------------------------------------------------------------------------
+const struct acpi_srat_local_x2apic *
+acpi_next_srat_local_x2apic(const struct acpi_srat_local_x2apic *prev);
+
+//----------------------------------------------------------------------------
+//  @function   acpi_next_srat_memory
+/// @brief      Return a pointer to the next memory affinity entry in the
+///             SRAT table.
+/// @param[in]  prev    Pointer to the entry returned by a previous call to
+///                     this function. Pass NULL for the first call.
+/// @returns    A pointer to the next entry, or NULL if none remain.
+//----------------------------------------------------------------------------
+const struct acpi_srat_memory *
+acpi_next_srat_memory(const struct acpi_srat_memory *prev);
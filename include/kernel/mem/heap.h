@@ -14,15 +14,60 @@
 
 typedef struct heap heap_t;
 
+// Free block size histogram buckets. Bucket i counts the free blocks of
+// size [2^(i+HEAP_HIST_SHIFT), 2^(i+HEAP_HIST_SHIFT+1)), with the first and
+// last buckets also holding the smaller and larger sizes.
+#define HEAP_HIST_SHIFT    5
+#define HEAP_HIST_BUCKETS  16
+
+//----------------------------------------------------------------------------
+//  @struct     heapblock_t
+/// @brief      A description of a heap block, as returned by heap_walk.
+//----------------------------------------------------------------------------
+typedef struct heapblock
+{
+    void    *ptr;           ///< Address of the block's contents
+    uint64_t size;          ///< Size of the block's contents in bytes
+    bool     allocated;     ///< True if the block is allocated
+} heapblock_t;
+
+//----------------------------------------------------------------------------
+//  @struct     heapstats_t
+/// @brief      A snapshot of a heap's memory use.
+//----------------------------------------------------------------------------
+typedef struct heapstats
+{
+    void    *vaddr;         ///< Address of the start of the heap
+    uint64_t pages;         ///< Pages reserved for the heap
+    uint64_t maxpages;      ///< Pages the heap may grow to fill
+    uint64_t used_blocks;   ///< Allocated blocks
+    uint64_t used_bytes;    ///< Bytes in allocated blocks
+    uint64_t free_blocks;   ///< Free blocks
+    uint64_t free_bytes;    ///< Bytes in free blocks
+    uint64_t largest_free;  ///< Bytes in the largest free block
+    uint64_t overhead;      ///< Bytes in the heap structure and block tags
+    uint64_t used_pages;    ///< Pages holding the heap structure or any
+                            ///  allocated block
+    uint64_t free_hist[HEAP_HIST_BUCKETS]; ///< Free blocks, by size
+    uint64_t allocs;        ///< Allocations made from the heap
+    uint64_t frees;         ///< Allocations returned to the heap
+    uint64_t reallocs;      ///< Allocations resized
+    uint64_t copies;        ///< Resized allocations that had to be moved
+    uint64_t trimmed;       ///< Pages trimmed from the end of the heap
+    uint64_t released;      ///< Pages released from inside free blocks
+} heapstats_t;
+
 //----------------------------------------------------------------------------
 //  @function   heap_create
 /// @brief      Create a new heap from which to allocate virtual memory.
 /// @param[in]  pt          The page table from which virtual memory is to be
-///                         allocated.
+///                         allocated, or NULL if the heap's maxpages pages
+///                         are already mapped (e.g., identity-mapped kernel
+///                         memory).
 /// @param[in]  vaddr       The virtual address of the first byte to use for
 ///                         the heap.
 /// @param[in]  maxpages    The maximum number of pages that the heap will
-///                         grow to fill.
+///                         grow to fill. Heaps are limited to 4GiB.
 /// @returns    A pointer to a the created heap structure.
 //----------------------------------------------------------------------------
 heap_t *
@@ -46,11 +91,103 @@ heap_destroy(heap_t *heap);
 void *
 heap_alloc(heap_t *heap, uint64_t size);
 
+//----------------------------------------------------------------------------
+//  @function   heap_alloc_aligned
+/// @brief      Allocate memory from a heap, aligned on a given boundary.
+/// @details    The returned memory may be freed with heap_free.
+/// @param[in]  heap    The heap from which to allocate the memory.
+/// @param[in]  size    The size, in bytes, of the allocation.
+/// @param[in]  align   The alignment, in bytes, of the allocation. Must be a
+///                     power of 2.
+/// @returns    A pointer to the allocated memory, or NULL if the memory
+///             could not be allocated.
+//----------------------------------------------------------------------------
+void *
+heap_alloc_aligned(heap_t *heap, uint64_t size, uint64_t align);
+
+//----------------------------------------------------------------------------
+//  @function   heap_realloc
+/// @brief      Resize memory previously allocated with heap_alloc.
+/// @details    The allocation is resized in place when possible, growing
+///             into the free block that follows it or onto the end of the
+///             heap. Otherwise it's moved to a newly allocated block.
+/// @param[in]  heap    The heap from which the memory was allocated.
+/// @param[in]  ptr     A pointer to the allocated memory, or NULL to make a
+///                     new allocation.
+/// @param[in]  size    The new size, in bytes, of the allocation. If 0, the
+///                     memory is freed.
+/// @returns    A pointer to the resized allocation, or NULL if it couldn't
+///             be resized (in which case the original allocation is left
+///             unchanged) or was freed.
+//----------------------------------------------------------------------------
+void *
+heap_realloc(heap_t *heap, void *ptr, uint64_t size);
+
 //----------------------------------------------------------------------------
 //  @function   heap_free
 /// @brief      Free memory previously allocated with heap_alloc.
+/// @details    If the end of the heap is left with many free pages, they
+///             are returned to the page table.
 /// @param[in]  heap    The heap from which the memory was allocated.
 /// @param[in]  ptr     A pointer to the memory that was allocated.
 //----------------------------------------------------------------------------
 void
 heap_free(heap_t *heap, void *ptr);
+
+//----------------------------------------------------------------------------
+//  @function   heap_release_unused
+/// @brief      Return the page frames of whole pages inside free blocks to
+///             the page table.
+/// @details    The pages remain reserved for the heap and are given zeroed
+///             frames when next touched. Heaps created without a page table
+///             keep their memory.
+/// @param[in]  heap    The heap.
+/// @returns    The number of pages released.
+//----------------------------------------------------------------------------
+uint64_t
+heap_release_unused(heap_t *heap);
+
+//----------------------------------------------------------------------------
+//  @function   heap_next
+/// @brief      Iterate over the registry of existing heaps.
+/// @param[in]  prev    The heap returned by the previous call, or NULL to
+///                     retrieve the first heap.
+/// @returns    The next heap, or NULL if there are no more.
+//----------------------------------------------------------------------------
+heap_t *
+heap_next(const heap_t *prev);
+
+//----------------------------------------------------------------------------
+//  @function   heap_walk
+/// @brief      Iterate over the blocks of a heap in address order.
+/// @details    The walk follows the block boundary tags, and stops early at
+///             a block that doesn't fit within the heap.
+/// @param[in]  heap    The heap.
+/// @param[inout] block On input, the block returned by the previous call,
+///                     or a block whose ptr is NULL to retrieve the first
+///                     block. On output, the next block.
+/// @returns    True if a block was returned, false if there are no more.
+//----------------------------------------------------------------------------
+bool
+heap_walk(const heap_t *heap, heapblock_t *block);
+
+//----------------------------------------------------------------------------
+//  @function   heap_check
+/// @brief      Check the consistency of a heap's blocks and free lists.
+/// @details    Takes time proportional to the number of blocks.
+/// @param[in]  heap    The heap.
+/// @returns    NULL if the heap is consistent. Otherwise, the address of the
+///             first corrupt block header, or of the heap itself if its free
+///             lists are corrupt.
+//----------------------------------------------------------------------------
+const void *
+heap_check(const heap_t *heap);
+
+//----------------------------------------------------------------------------
+//  @function   heap_stats
+/// @brief      Retrieve a snapshot of a heap's memory use.
+/// @param[in]  heap    The heap.
+/// @param[out] stats   The structure to receive the statistics.
+//----------------------------------------------------------------------------
+void
+heap_stats(const heap_t *heap, heapstats_t *stats);
@@ -0,0 +1,91 @@
+//============================================================================
+/// @file       kmalloc.h
+/// @brief      General-purpose kernel memory allocator.
+/// @details    Small allocations are carved out of size-class slabs, and
+///             larger ones are taken from the calling CPU's heap arena.
+///             Memory may be freed by any CPU. All memory handed out is
+///             identity-mapped by the kernel page table, so it's accessible
+///             no matter which page table is active.
+//
+//  Copyright 2016 Brett Vickers.
+//  Use of this source code is governed by a BSD-style license
+//  that can be found in the MonkOS LICENSE file.
+//============================================================================
+
+#pragma once
+
+#include <core.h>
+#include <kernel/x86/cpu.h>
+
+// Slab size classes, which are the powers of 2 from KMALLOC_MIN_SIZE to
+// KMALLOC_MAX_SIZE. Larger allocations are taken from the kernel heap.
+#define KMALLOC_MIN_SIZE     8
+#define KMALLOC_MAX_SIZE     2048
+#define KMALLOC_CLASSES      9
+
+//----------------------------------------------------------------------------
+//  @struct     kmallocarenastats_t
+/// @brief      A snapshot of one CPU's large-allocation arena.
+//----------------------------------------------------------------------------
+typedef struct kmallocarenastats
+{
+    uint64_t pages;         ///< Pages spanned by the arena (0 if unused)
+    uint64_t used_bytes;    ///< Bytes in allocated blocks
+    uint64_t allocs;        ///< Allocations made by the owning CPU
+    uint64_t frees;         ///< Allocations freed by the owning CPU,
+                            ///  including drained remote frees
+    uint64_t remote_frees;  ///< Allocations freed by other CPUs
+    uint64_t drains;        ///< Remote-free lists drained by the owner
+} kmallocarenastats_t;
+
+//----------------------------------------------------------------------------
+//  @struct     kmallocstats_t
+/// @brief      A snapshot of the kernel allocator's state.
+//----------------------------------------------------------------------------
+typedef struct kmallocstats
+{
+    uint32_t slab_pages;                  ///< Pages reserved for slabs
+    uint32_t slab_pages_used;             ///< Pages assigned to a size class
+    uint32_t slabs[KMALLOC_CLASSES];      ///< Slabs, by size class
+    uint64_t objects[KMALLOC_CLASSES];    ///< Objects in use, by size class
+    uint64_t allocs;                      ///< Successful kmalloc calls
+    uint64_t frees;                       ///< kfree calls
+    uint64_t heap_allocs;                 ///< kmalloc calls using arenas
+    kmallocarenastats_t arena[MAX_CPUS];  ///< Arenas, by CPU
+} kmallocstats_t;
+
+//----------------------------------------------------------------------------
+//  @function   kmalloc_init
+/// @brief      Reserve the memory used by the kernel allocator.
+/// @details    Must be called after page_init.
+//----------------------------------------------------------------------------
+void
+kmalloc_init();
+
+//----------------------------------------------------------------------------
+//  @function   kmalloc
+/// @brief      Allocate kernel memory.
+/// @details    Allocations are aligned to the smaller of 16 bytes and the
+///             power of 2 holding their size.
+/// @param[in]  size    The number of bytes to allocate.
+/// @returns    A pointer to the allocated memory, or NULL if the memory
+///             could not be allocated.
+//----------------------------------------------------------------------------
+void *
+kmalloc(uint64_t size);
+
+//----------------------------------------------------------------------------
+//  @function   kfree
+/// @brief      Free memory previously allocated with kmalloc.
+/// @param[in]  ptr     Pointer to the memory to free. May be NULL.
+//----------------------------------------------------------------------------
+void
+kfree(void *ptr);
+
+//----------------------------------------------------------------------------
+//  @function   kmalloc_stats
+/// @brief      Retrieve the state of the kernel allocator.
+/// @param[out] stats   The structure to receive the state.
+//----------------------------------------------------------------------------
+void
+kmalloc_stats(kmallocstats_t *stats);
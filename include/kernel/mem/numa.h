@@ -0,0 +1,81 @@
+//============================================================================
+/// @file       numa.h
+/// @brief      Non-uniform memory access (NUMA) topology.
+/// @details    Describes which proximity domain (node) each range of
+///             physical memory and each CPU belongs to, and the relative
+///             distances between nodes, as reported by the ACPI SRAT and
+///             SLIT tables.
+//
+//  Copyright 2016 Brett Vickers.
+//  Use of this source code is governed by a BSD-style license
+//  that can be found in the MonkOS LICENSE file.
+//============================================================================
+
+#pragma once
+
+#include <core.h>
+
+// Maximum number of NUMA nodes supported by the kernel
+#define MAX_NUMA_NODES   8
+
+// Relative distances used when the firmware provides no SLIT
+#define NUMA_DISTANCE_LOCAL   10
+#define NUMA_DISTANCE_REMOTE  20
+
+//----------------------------------------------------------------------------
+//  @function   numa_init
+/// @brief      Build the NUMA topology from the ACPI SRAT and SLIT tables.
+/// @details    If no SRAT is present, all memory and CPUs are assigned to a
+///             single node. Must be called after acpi_init.
+//----------------------------------------------------------------------------
+void
+numa_init();
+
+//----------------------------------------------------------------------------
+//  @function   numa_nodes
+/// @brief      Return the number of NUMA nodes in the system.
+/// @returns    The node count (at least 1).
+//----------------------------------------------------------------------------
+int
+numa_nodes();
+
+//----------------------------------------------------------------------------
+//  @function   numa_paddr_node
+/// @brief      Return the node containing a physical address.
+/// @param[in]  paddr   The physical address.
+/// @param[out] term    Receives the end of the contiguous range of physical
+///                     memory belonging to the same node. May be NULL.
+/// @returns    The node index.
+//----------------------------------------------------------------------------
+int
+numa_paddr_node(uint64_t paddr, uint64_t *term);
+
+//----------------------------------------------------------------------------
+//  @function   numa_cpu_node
+/// @brief      Return the node local to a CPU.
+/// @param[in]  cpu     The CPU index.
+/// @returns    The node index.
+//----------------------------------------------------------------------------
+int
+numa_cpu_node(int cpu);
+
+//----------------------------------------------------------------------------
+//  @function   numa_distance
+/// @brief      Return the relative memory access distance between two nodes.
+/// @param[in]  from    The node index of the accessing CPU.
+/// @param[in]  to      The node index of the accessed memory.
+/// @returns    The distance (NUMA_DISTANCE_LOCAL for the same node).
+//----------------------------------------------------------------------------
+int
+numa_distance(int from, int to);
+
+//----------------------------------------------------------------------------
+//  @function   numa_fallback
+/// @brief      Return the order in which nodes should be tried when
+///             allocating memory on behalf of a node.
+/// @param[in]  node    The node index.
+/// @returns    An array of numa_nodes() node indices, sorted by increasing
+///             distance from the node, starting with the node itself.
+//----------------------------------------------------------------------------
+const uint8_t *
+numa_fallback(int node);
@@ -10,12 +10,21 @@
 #pragma once
 
 #include <core.h>
+#include <kernel/mem/numa.h>
+#include <kernel/mem/pmap.h>
 
 // Pag size constants
 #define PAGE_SIZE        0x1000
 #define PAGE_SIZE_LARGE  0x200000
 #define PAGE_SIZE_HUGE   0x40000000
 
+// Page frame block orders (a block of order N holds 2^N contiguous frames)
+#define PFORDER_SMALL    0          // 4KiB block
+#define PFORDER_LARGE    9          // 2MiB block
+#define PFORDER_HUGE     18         // 1GiB block
+#define PFORDER_MAX      PFORDER_HUGE
+#define PFORDER_COUNT    (PFORDER_MAX + 1)
+
 // Page table entry flags
 #define PF_PRESENT       (1 << 0)   // Page is present in the table
 #define PF_RW            (1 << 1)   // Read-write
@@ -25,8 +34,13 @@
 #define PF_ACCESS        (1 << 5)   // Indicates whether page was accessed
 #define PF_DIRTY         (1 << 6)   // Indicates whether 4K page was written
 #define PF_PS            (1 << 7)   // Page size (valid for PD and PDPT only)
+#define PF_PAT           (1 << 7)   // Page attribute index bit (PT only)
 #define PF_GLOBAL        (1 << 8)   // Indicates the page is globally cached
 #define PF_SYSTEM        (1 << 9)   // Page used by the kernel
+#define PF_DEMAND        (1 << 10)  // Non-present page allocated on access
+#define PF_COW           (1 << 11)  // Read-only page copied on write
+#define PF_SWAP          (1 << 11)  // Non-present page in compressed swap
+#define PF_PAT_LARGE     (1 << 12)  // Page attribute index bit (PD and PDPT)
 
 // Virtual address bitmasks and shifts
 #define PGSHIFT_PML4E    39
@@ -34,7 +48,7 @@
 #define PGSHIFT_PDE      21
 #define PGSHIFT_PTE      12
 #define PGMASK_ENTRY     0x1ff
-#define PGMASK_OFFSET    0x3ff
+#define PGMASK_OFFSET    0xfff
 
 // Virtual address subfield accessors
 #define PML4E(a)         (((a) >> PGSHIFT_PML4E) & PGMASK_ENTRY)
@@ -69,8 +83,85 @@ typedef struct pagetable
     uint64_t vroot;     ///< Virtual address of root page table (PML4T) entry
     uint64_t vnext;     ///< Virtual address to use for table's next page
     uint64_t vterm;     ///< Boundary of pages used to store the table
+    uint64_t pcid;      ///< Process-context identifier assigned to table
+    uint64_t hand;      ///< Virtual address where the swap scan resumes
+    uint32_t rss;       ///< Resident pages seen by the last reclaim sweep
+    uint32_t wss;       ///< Pages referenced since the previous sweep
+    struct pagetable *next; ///< Next page table in the registry
 } pagetable_t;
 
+//----------------------------------------------------------------------------
+//  @struct     pfstats_t
+/// @brief      A snapshot of the page frame database's allocation state.
+//----------------------------------------------------------------------------
+typedef struct pfstats
+{
+    uint32_t total;                      ///< Frames described by the pfdb
+    uint64_t dbsize;                     ///< Bytes of memory used by pfdb
+    uint32_t avail;                      ///< Frames currently available
+    uint32_t deferred;                   ///< Available frames whose records
+                                         ///  aren't yet initialized
+    uint32_t blocks[PFORDER_COUNT];      ///< Available blocks of each order
+    int      nodes;                      ///< Number of NUMA nodes
+    uint32_t node_avail[MAX_NUMA_NODES]; ///< Buddy-list frames on each node
+    uint32_t cached;                     ///< Available frames in CPU caches
+    uint64_t cache_hits;                 ///< Allocs/frees served by caches
+    uint64_t cache_refills;              ///< Cache batches pulled from pfdb
+    uint64_t cache_drains;               ///< Cache batches returned to pfdb
+    uint32_t zeroed;                     ///< Available pre-zeroed frames
+    uint64_t zero_hits;                  ///< Page allocs using pre-zeroed
+    uint64_t zero_misses;                ///< Page allocs zeroed on demand
+} pfstats_t;
+
+//----------------------------------------------------------------------------
+//  @struct     pgstats_t
+/// @brief      Paging activity counters.
+//----------------------------------------------------------------------------
+typedef struct pgstats
+{
+    uint64_t demand_faults;      ///< Faults that allocated a reserved page
+    uint64_t demand_cycles;      ///< Total cycles spent on demand faults
+    uint64_t demand_max_cycles;  ///< Slowest demand fault, in cycles
+    uint64_t eager_pages;        ///< Pages allocated by page_alloc
+    uint64_t eager_cycles;       ///< Total cycles spent in page_alloc
+    uint64_t cow_shares;         ///< Pages shared by pagetable_clone
+    uint64_t cow_copies;         ///< Write faults resolved by copying
+    uint64_t cow_reuses;         ///< Write faults resolved by taking over
+    uint64_t tlb_page_flushes;   ///< Single-page TLB invalidations
+    uint64_t tlb_full_flushes;   ///< Full TLB flushes
+    uint64_t pcid_hits;          ///< Activations that kept TLB entries
+    uint64_t pcid_misses;        ///< Activations that flushed TLB entries
+    uint64_t swap_outs;          ///< Pages compressed into swap
+    uint64_t swap_ins;           ///< Pages decompressed from swap
+    uint64_t lru_scans;          ///< Page table entries aged by the scanner
+    uint64_t lru_sweeps;         ///< Page tables swept by the scanner
+    uint64_t lru_activations;    ///< Frames moved to the active list
+    uint64_t lru_deactivations;  ///< Frames moved to the inactive list
+    uint64_t zero_faults;        ///< Read faults mapped to the zero page
+    uint64_t merge_hashes;       ///< Cold pages hashed by the merger
+    uint64_t merge_pages;        ///< Frames freed by merging identical pages
+    uint64_t kmap_splits;        ///< Kernel large pages split to retype
+    uint64_t kmap_merges;        ///< Kernel tables merged into large pages
+    uint32_t lru_active;         ///< Frames currently on the active list
+    uint32_t lru_inactive;       ///< Frames currently on the inactive list
+} pgstats_t;
+
+//----------------------------------------------------------------------------
+//  @struct     memstats_t
+/// @brief      A snapshot of physical memory use, for capacity planning.
+//----------------------------------------------------------------------------
+typedef struct memstats
+{
+    uint64_t free[PMEMTYPE_COUNT];      ///< Available frames, by pmemtype
+    uint64_t allocated[PMEMTYPE_COUNT]; ///< Allocated frames, by pmemtype
+    uint64_t reserved[PMEMTYPE_COUNT];  ///< Reserved frames, by pmemtype
+    uint64_t table_pages;   ///< Page table pages allocated by add_pte
+    uint64_t allocs;        ///< Frames allocated since boot
+    uint64_t frees;         ///< Frames freed since boot
+    uint64_t alloc_rate;    ///< Frames allocated per second
+    uint64_t free_rate;     ///< Frames freed per second
+} memstats_t;
+
 //----------------------------------------------------------------------------
 //  @function   page_init
 /// @brief      Initialize the page frame database.
@@ -104,6 +195,22 @@ pagetable_create(pagetable_t *pt, void *vaddr, uint64_t size);
 void
 pagetable_destroy(pagetable_t *pt);
 
+//----------------------------------------------------------------------------
+//  @function   pagetable_clone
+/// @brief      Create a new page table that shares all of another page
+///             table's non-kernel pages.
+/// @details    Writable pages are shared copy-on-write: they become
+///             read-only in both page tables, and the first write to one of
+///             them through either table gives that table its own copy. The
+///             clone's table pages are mapped at the same virtual address
+///             range as the source's.
+/// @param[out] dst     A pointer to the pagetable structure that will hold
+///                     the cloned page table.
+/// @param[in]  src     The page table to clone.
+//----------------------------------------------------------------------------
+void
+pagetable_clone(pagetable_t *dst, pagetable_t *src);
+
 //----------------------------------------------------------------------------
 //  @function   pagetable_activate
 /// @brief      Activate a page table on the CPU, so all virtual memory
@@ -114,6 +221,17 @@ pagetable_destroy(pagetable_t *pt);
 void
 pagetable_activate(pagetable_t *pt);
 
+//----------------------------------------------------------------------------
+//  @function   pagetable_next
+/// @brief      Iterate over the registry of existing page tables, which
+///             starts with the kernel page table.
+/// @param[in]  prev    The page table returned by the previous call, or NULL
+///                     to retrieve the first page table.
+/// @returns    The next page table, or NULL if there are no more.
+//----------------------------------------------------------------------------
+const pagetable_t *
+pagetable_next(const pagetable_t *prev);
+
 //----------------------------------------------------------------------------
 //  @function   page_alloc
 /// @brief      Allocate one or more pages contiguous in virtual memory.
@@ -127,13 +245,179 @@ pagetable_activate(pagetable_t *pt);
 void *
 page_alloc(pagetable_t *pt, void *vaddr, int count);
 
+//----------------------------------------------------------------------------
+//  @function   page_reserve
+/// @brief      Reserve one or more pages contiguous in virtual memory,
+///             without allocating physical memory for them.
+/// @details    Reading a page before it's written maps the shared zero
+///             page, and each page is allocated and zeroed by the page fault
+///             handler the first time it is written. Reserved pages are
+///             released with page_free.
+/// @param[in]  pt      Handle to the page table in which to reserve the
+///                     page(s).
+/// @param[in]  vaddr   The virtual address of the first reserved page.
+/// @param[in]  count   The number of contiguous virtual memory pages to
+///                     reserve.
+/// @returns    A virtual memory pointer to the first page reserved.
+//----------------------------------------------------------------------------
+void *
+page_reserve(pagetable_t *pt, void *vaddr, int count);
+
+//----------------------------------------------------------------------------
+//  @function   page_alloc_large
+/// @brief      Allocate one or more 2MiB large pages contiguous in virtual
+///             memory, each backed by physically contiguous frames.
+/// @param[in]  pt      Handle to the page table from which to allocate the
+///                     page(s).
+/// @param[in]  vaddr   The virtual address of the first allocated page. Must
+///                     be aligned to PAGE_SIZE_LARGE.
+/// @param[in]  count   The number of contiguous 2MiB pages to allocate.
+/// @returns    A virtual memory pointer to the first page allocated.
+//----------------------------------------------------------------------------
+void *
+page_alloc_large(pagetable_t *pt, void *vaddr, int count);
+
+//----------------------------------------------------------------------------
+//  @function   page_alloc_huge
+/// @brief      Allocate one or more 1GiB huge pages contiguous in virtual
+///             memory, each backed by physically contiguous frames.
+/// @param[in]  pt      Handle to the page table from which to allocate the
+///                     page(s).
+/// @param[in]  vaddr   The virtual address of the first allocated page. Must
+///                     be aligned to PAGE_SIZE_HUGE.
+/// @param[in]  count   The number of contiguous 1GiB pages to allocate.
+/// @returns    A virtual memory pointer to the first page allocated.
+//----------------------------------------------------------------------------
+void *
+page_alloc_huge(pagetable_t *pt, void *vaddr, int count);
+
 //----------------------------------------------------------------------------
 //  @function   page_free
 /// @brief      Free one or more contiguous pages from virtual memory.
+/// @details    Large and huge pages within the range are freed as a whole,
+///             so the range must cover each of them entirely.
 /// @param[in]  pt      Handle to ehte page table from which to free the
 ///                     page(s).
 /// @param[in]  vaddr   The virtual address of the first allocated page.
-/// @param[in]  count   The number of contiguous virtual memory pages to free.
+/// @param[in]  count   The number of contiguous 4KiB virtual memory pages to
+///                     free.
 //----------------------------------------------------------------------------
 void
 page_free(pagetable_t *pt, void *vaddr, int count);
+
+//----------------------------------------------------------------------------
+//  @function   page_frame_alloc
+/// @brief      Allocate a block of physically contiguous page frames.
+/// @details    The block holds 2^order frames and is naturally aligned to
+///             its size. Its contents are zeroed.
+/// @param[in]  order   The block order (PFORDER_SMALL through PFORDER_MAX).
+/// @returns    The physical address of the first frame in the block, or 0
+///             if no sufficiently large block is available.
+//----------------------------------------------------------------------------
+uint64_t
+page_frame_alloc(int order);
+
+//----------------------------------------------------------------------------
+//  @function   page_frame_free
+/// @brief      Free a block of page frames allocated with page_frame_alloc.
+/// @param[in]  paddr   The physical address of the first frame in the block.
+/// @param[in]  order   The order of the block passed to page_frame_alloc.
+//----------------------------------------------------------------------------
+void
+page_frame_free(uint64_t paddr, int order);
+
+//----------------------------------------------------------------------------
+//  @function   page_set_memtype
+/// @brief      Change the memory type of a range of physical memory in the
+///             kernel's live identity map.
+/// @details    Huge and large pages only partially covered by the range
+///             are split as far as needed, and tables left mapping
+///             contiguous memory of a single type are merged back into
+///             large and huge pages. Only the TLB entries of affected pages
+///             are invalidated. The range's type is recorded in the
+///             physical memory map. Usable memory can't be retyped.
+/// @param[in]  paddr   The physical address of the range.
+/// @param[in]  size    The size of the range in bytes.
+/// @param[in]  type    The new memory type. PMEMTYPE_UNMAPPED unmaps the
+///                     range.
+/// @returns    True if the range was retyped.
+//----------------------------------------------------------------------------
+bool
+page_set_memtype(uint64_t paddr, uint64_t size, enum pmemtype type);
+
+//----------------------------------------------------------------------------
+//  @function   ioremap
+/// @brief      Map a range of device memory, such as a frame buffer or a
+///             PCI BAR, into the kernel's page table with a memory type.
+/// @details    The kernel identity-maps physical memory, so the range is
+///             mapped at its physical address, using page_set_memtype.
+/// @param[in]  paddr   The physical address of the range.
+/// @param[in]  size    The size of the range in bytes.
+/// @param[in]  type    PMEMTYPE_UNCACHED, PMEMTYPE_WRITETHROUGH or
+///                     PMEMTYPE_WRITECOMBINE.
+/// @returns    The virtual address of the range, or NULL if the range
+///             couldn't be mapped with the type.
+//----------------------------------------------------------------------------
+void *
+ioremap(uint64_t paddr, uint64_t size, enum pmemtype type);
+
+//----------------------------------------------------------------------------
+//  @function   page_idle
+/// @brief      Perform deferred paging work while the CPU is otherwise idle.
+/// @details    Initializes a deferred section of the page frame database,
+///             zeroes a small batch of free frames into the pool of
+///             pre-zeroed pages used by page allocations, and advances the
+///             reclaim scanner that ages the pages of every page table.
+///             Call this before halting the CPU.
+/// @returns    True if more idle work remains, false if the caller may
+///             halt.
+//----------------------------------------------------------------------------
+bool
+page_idle();
+
+//----------------------------------------------------------------------------
+//  @function   page_merge_enable
+/// @brief      Enable or disable same-page merging.
+/// @details    While enabled, the reclaim scanner hashes the contents of
+///             pages that have gone unreferenced for a full sweep, and
+///             maps identical pages to a single read-only frame shared
+///             copy-on-write. Pages of zeros are merged into the shared
+///             zero page. Merging is disabled by default.
+/// @param[in]  enable  True to enable merging, false to disable it.
+//----------------------------------------------------------------------------
+void
+page_merge_enable(bool enable);
+
+//----------------------------------------------------------------------------
+//  @function   page_merge_enabled
+/// @brief      Return true if same-page merging is enabled.
+//----------------------------------------------------------------------------
+bool
+page_merge_enabled();
+
+//----------------------------------------------------------------------------
+//  @function   page_frame_stats
+/// @brief      Retrieve the current state of the page frame database.
+/// @param[out] stats   The structure to receive the statistics.
+//----------------------------------------------------------------------------
+void
+page_frame_stats(pfstats_t *stats);
+
+//----------------------------------------------------------------------------
+//  @function   page_mem_stats
+/// @brief      Retrieve a snapshot of physical memory use.
+/// @details    Allocation and free rates are measured over the most recent
+///             interval of at least a second that ended while the CPU was
+///             idle.
+/// @param[out] stats   The structure to receive the statistics.
+//----------------------------------------------------------------------------
+void
+page_mem_stats(memstats_t *stats);
+
+//----------------------------------------------------------------------------
+//  @function   page_stats
+/// @brief      Retrieve the paging activity counters.
+/// @param[out] stats   The structure to receive the counters.
+//----------------------------------------------------------------------------
+void
+page_stats(pgstats_t *stats);
@@ -20,13 +20,17 @@
 //----------------------------------------------------------------------------
 enum pmemtype
 {
-    PMEMTYPE_USABLE   = 1,   ///< Reported usable by the BIOS.
-    PMEMTYPE_RESERVED = 2,   ///< Reported (or inferred) to be reserved.
-    PMEMTYPE_ACPI     = 3,   ///< Used for ACPI tables or code.
-    PMEMTYPE_ACPI_NVS = 4,   ///< Used for ACPI non-volatile storage.
-    PMEMTYPE_BAD      = 5,   ///< Reported as bad memory.
-    PMEMTYPE_UNCACHED = 6,   ///< Marked as uncacheable, usually for I/O.
-    PMEMTYPE_UNMAPPED = 7,   ///< Marked as "do not map".
+    PMEMTYPE_USABLE       = 1, ///< Reported usable by the BIOS.
+    PMEMTYPE_RESERVED     = 2, ///< Reported (or inferred) to be reserved.
+    PMEMTYPE_ACPI         = 3, ///< Used for ACPI tables or code.
+    PMEMTYPE_ACPI_NVS     = 4, ///< Used for ACPI non-volatile storage.
+    PMEMTYPE_BAD          = 5, ///< Reported as bad memory.
+    PMEMTYPE_UNCACHED     = 6, ///< Marked as uncacheable, usually for I/O.
+    PMEMTYPE_UNMAPPED     = 7, ///< Marked as "do not map".
+    PMEMTYPE_WRITETHROUGH = 8, ///< Cached write-through, for I/O.
+    PMEMTYPE_WRITECOMBINE = 9, ///< Uncached, but with writes combined in a
+                               ///  buffer, usually for frame buffers.
+    PMEMTYPE_COUNT,            ///< One more than the last memory type.
 };
 
 //----------------------------------------------------------------------------
@@ -0,0 +1,74 @@
+//============================================================================
+/// @file       zswap.h
+/// @brief      Compressed in-memory page store.
+/// @details    Holds the LZ-compressed contents of pages swapped out by the
+///             paging module, so memory can be overcommitted without a
+///             swap device.
+//
+//  Copyright 2016 Brett Vickers.
+//  Use of this source code is governed by a BSD-style license
+//  that can be found in the MonkOS LICENSE file.
+//============================================================================
+
+#pragma once
+
+#include <core.h>
+
+//----------------------------------------------------------------------------
+//  @struct     zswapstats_t
+/// @brief      A snapshot of the compressed page store's state.
+//----------------------------------------------------------------------------
+typedef struct zswapstats
+{
+    uint32_t pages;         ///< Pages currently held in the store
+    uint32_t frames;        ///< Page frames used to hold compressed pages
+    uint64_t bytes;         ///< Compressed bytes currently held
+    uint64_t stores;        ///< Pages stored
+    uint64_t rejects;       ///< Pages that couldn't be stored
+} zswapstats_t;
+
+//----------------------------------------------------------------------------
+//  @function   zswap_store
+/// @brief      Compress a page and add it to the store.
+/// @details    Pages that don't compress to a fraction of their size, or
+///             that don't fit in the store, are rejected.
+/// @param[in]  page    Pointer to the PAGE_SIZE bytes to store.
+/// @returns    A non-zero slot number identifying the stored page, or 0 if
+///             the page was rejected.
+//----------------------------------------------------------------------------
+uint32_t
+zswap_store(const void *page);
+
+//----------------------------------------------------------------------------
+//  @function   zswap_load
+/// @brief      Decompress a stored page.
+/// @param[in]  slot    The slot number of the stored page.
+/// @param[out] page    Pointer to the PAGE_SIZE bytes receiving the page.
+//----------------------------------------------------------------------------
+void
+zswap_load(uint32_t slot, void *page);
+
+//----------------------------------------------------------------------------
+//  @function   zswap_dup
+/// @brief      Add a reference to a stored page.
+/// @param[in]  slot    The slot number of the stored page.
+//----------------------------------------------------------------------------
+void
+zswap_dup(uint32_t slot);
+
+//----------------------------------------------------------------------------
+//  @function   zswap_free
+/// @brief      Release a reference to a stored page, removing it from the
+///             store when no references remain.
+/// @param[in]  slot    The slot number of the stored page.
+//----------------------------------------------------------------------------
+void
+zswap_free(uint32_t slot);
+
+//----------------------------------------------------------------------------
+//  @function   zswap_stats
+/// @brief      Retrieve the state of the compressed page store.
+/// @param[out] stats   The structure to receive the state.
+//----------------------------------------------------------------------------
+void
+zswap_stats(zswapstats_t *stats);
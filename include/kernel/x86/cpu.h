@@ -11,6 +11,9 @@
 
 #include <core.h>
 
+// Maximum number of CPUs supported by the kernel
+#define MAX_CPUS               16
+
 // CPU EFLAGS register values
 #define CPU_EFLAGS_CARRY       (1 << 0)
 #define CPU_EFLAGS_PARITY      (1 << 2)
@@ -31,6 +34,23 @@
 #define CPU_EFLAGS_VPENDING    (1 << 20)
 #define CPU_EFLAGS_CPUID       (1 << 21)
 
+// CPU CR0 register values
+#define CPU_CR0_WP             (1 << 16)
+
+// CPU CR4 register values
+#define CPU_CR4_PGE            (1 << 7)
+#define CPU_CR4_PCIDE          (1 << 17)
+
+// CPU CR3 register values
+#define CPU_CR3_PCID_MASK      0xfff
+#define CPU_CR3_NOFLUSH        (1ull << 63)
+
+// INVPCID invalidation types
+#define INVPCID_ADDRESS        0    // One address in one PCID
+#define INVPCID_CONTEXT        1    // All non-global entries in one PCID
+#define INVPCID_ALL_GLOBAL     2    // All entries in all PCIDs
+#define INVPCID_ALL            3    // All non-global entries in all PCIDs
+
 //----------------------------------------------------------------------------
 //  @struct     registers_t
 /// @brief      A record describing all 64-bit general-purpose registers.
@@ -72,6 +92,7 @@ typedef struct registers4
 //----------------------------------------------------------------------------
 //  @function   cpuid
 /// @brief      Return the results of the CPUID instruction.
+/// @details    Leaves with sub-leaves report sub-leaf 0.
 /// @param[in]  code    The cpuid group code.
 /// @param[out] regs    The contents of registers rax, rbx, rcx, and rdx.
 //----------------------------------------------------------------------------
@@ -154,6 +175,9 @@ io_outd(uint16_t port, uint32_t value);
 //  @function   set_pagetable
 /// @brief      Update the CPU's page table register.
 /// @param[in]  paddr   The physical address containing the new pagetable.
+///                     When PCIDs are enabled, the low 12 bits hold the
+///                     PCID and CPU_CR3_NOFLUSH may be set to preserve the
+///                     PCID's TLB entries.
 //----------------------------------------------------------------------------
 void
 set_pagetable(uint64_t paddr);
@@ -166,6 +190,85 @@ set_pagetable(uint64_t paddr);
 void
 invalidate_page(void *vaddr);
 
+//-----------------------------------------------------------------------------
+//  @function   invalidate_pcid
+/// @brief      Invalidate TLB entries tagged with a process-context
+///             identifier, using the INVPCID instruction.
+/// @param[in]  type    The invalidation type (INVPCID_ADDRESS, etc.).
+/// @param[in]  pcid    The PCID whose entries should be invalidated.
+/// @param[in]  vaddr   The virtual address to invalidate, for
+///                     INVPCID_ADDRESS invalidations.
+//-----------------------------------------------------------------------------
+void
+invalidate_pcid(uint64_t type, uint64_t pcid, void *vaddr);
+
+//----------------------------------------------------------------------------
+//  @function   flush_cache
+/// @brief      Write back and invalidate the contents of all CPU caches.
+/// @details    Required when the memory type of a mapping changes, so no
+///             stale lines cached under the old type remain.
+//----------------------------------------------------------------------------
+void
+flush_cache();
+
+//----------------------------------------------------------------------------
+//  @function   get_cr0
+/// @brief      Return the contents of the CR0 control register.
+/// @returns    The contents of CR0.
+//----------------------------------------------------------------------------
+uint64_t
+get_cr0();
+
+//----------------------------------------------------------------------------
+//  @function   set_cr0
+/// @brief      Update the CR0 control register.
+/// @param[in]  value   The new contents of CR0.
+//----------------------------------------------------------------------------
+void
+set_cr0(uint64_t value);
+
+//----------------------------------------------------------------------------
+//  @function   get_cr4
+/// @brief      Return the contents of the CR4 control register.
+/// @returns    The contents of CR4.
+//----------------------------------------------------------------------------
+uint64_t
+get_cr4();
+
+//----------------------------------------------------------------------------
+//  @function   set_cr4
+/// @brief      Update the CR4 control register.
+/// @param[in]  value   The new contents of CR4.
+//----------------------------------------------------------------------------
+void
+set_cr4(uint64_t value);
+
+//----------------------------------------------------------------------------
+//  @function   rdtsc
+/// @brief      Read the CPU's time-stamp counter.
+/// @returns    The number of cycles elapsed since the CPU was reset.
+//----------------------------------------------------------------------------
+uint64_t
+rdtsc();
+
+//----------------------------------------------------------------------------
+//  @function   get_pagefault_addr
+/// @brief      Return the virtual address that caused the last page fault.
+/// @returns    The contents of the CR2 register.
+//----------------------------------------------------------------------------
+uint64_t
+get_pagefault_addr();
+
+//----------------------------------------------------------------------------
+//  @function   cpu_index
+/// @brief      Return the index of the CPU executing the caller.
+/// @details    Only the bootstrap processor runs kernel code for now, so
+///             the index is always 0.
+/// @returns    A CPU index in the range [0:MAX_CPUS-1].
+//----------------------------------------------------------------------------
+int
+cpu_index();
+
 //----------------------------------------------------------------------------
 //  @function   enable_interrupts
 /// @brief      Enable interrupts.
@@ -20,7 +20,7 @@ cpuid(uint32_t code, registers4_t *regs)
         "cpuid"
         : "=a" (regs->rax), "=b" (regs->rbx), "=c" (regs->rcx),
         "=d" (regs->rdx)
-        : "0" (code));
+        : "0" (code), "2" (0));
 }
 
 __forceinline uint64_t
@@ -126,10 +126,93 @@ invalidate_page(void *vaddr)
     asm volatile (
         "invlpg     %[v]\n"
         :
-        : [v] "m" (vaddr)
+        : [v] "m" (*(char *)vaddr)
         : "memory");
 }
 
+__forceinline void
+invalidate_pcid(uint64_t type, uint64_t pcid, void *vaddr)
+{
+    struct { uint64_t pcid, vaddr; } desc = { pcid, (uint64_t)vaddr };
+    asm volatile (
+        "invpcid    %[t],   %[d]\n"
+        :
+        : [t] "r" (type), [d] "m" (desc)
+        : "memory");
+}
+
+__forceinline void
+flush_cache()
+{
+    asm volatile ("wbinvd" ::: "memory");
+}
+
+__forceinline uint64_t
+get_cr0()
+{
+    uint64_t value;
+    asm volatile (
+        "mov    %[v],   cr0\n"
+        : [v] "=r" (value));
+    return value;
+}
+
+__forceinline void
+set_cr0(uint64_t value)
+{
+    asm volatile (
+        "mov    cr0,    %[v]\n"
+        :
+        : [v] "r" (value)
+        : "memory");
+}
+
+__forceinline uint64_t
+get_cr4()
+{
+    uint64_t value;
+    asm volatile (
+        "mov    %[v],   cr4\n"
+        : [v] "=r" (value));
+    return value;
+}
+
+__forceinline void
+set_cr4(uint64_t value)
+{
+    asm volatile (
+        "mov    cr4,    %[v]\n"
+        :
+        : [v] "r" (value)
+        : "memory");
+}
+
+__forceinline uint64_t
+rdtsc()
+{
+    uint32_t lo, hi;
+    asm volatile (
+        "rdtsc"
+        : "=a" (lo), "=d" (hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+__forceinline uint64_t
+get_pagefault_addr()
+{
+    uint64_t vaddr;
+    asm volatile (
+        "mov    %[v],   cr2\n"
+        : [v] "=r" (vaddr));
+    return vaddr;
+}
+
+__forceinline int
+cpu_index()
+{
+    return 0;
+}
+
 __forceinline void
 enable_interrupts()
 {
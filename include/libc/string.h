@@ -69,6 +69,20 @@ strlcat(char *dst, const char *src, size_t dstsize);
 int
 strcmp(const char *str1, const char *str2);
 
+//----------------------------------------------------------------------------
+//  @function   memcmp
+/// @brief      Compare the bytes of one memory region to another.
+/// @param[in]  ptr1    Address of the first memory area.
+/// @param[in]  ptr2    Address of the second memory area.
+/// @param[in]  num     Number of bytes to compare.
+/// @returns    < 0 if the first byte in ptr1 that doesn't match a byte in
+///                 ptr2 has a lower value.
+///             = 0 if the two memory areas are identical.
+///             > 0 otherwise.
+//----------------------------------------------------------------------------
+int
+memcmp(const void *ptr1, const void *ptr2, size_t num);
+
 //----------------------------------------------------------------------------
 //  @function   memcpy
 /// @brief      Copy bytes from one memory region to another.
@@ -22,12 +22,15 @@
 #define MIN_FREQUENCY        19
 #define MAX_FREQUENCY        1193181
 
+static uint32_t          timer_hz;    // Interrupt frequency (0 until init)
+static volatile uint64_t timer_count; // Interrupts since init
+
 static void
 isr_timer(const interrupt_context_t *context)
 {
     (void)context;
 
-    // Do nothing for now.
+    timer_count++;
 
     // Send the end-of-interrupt signal.
     io_outb(PIC_PORT_CMD_MASTER, PIC_CMD_EOI);
@@ -44,8 +47,10 @@ timer_init(uint32_t frequency)
         frequency = MAX_FREQUENCY;
     }
 
-    // Compute the clock count value.
+    // Compute the clock count value, and the frequency it actually
+    // produces.
     uint16_t count = (uint16_t)(MAX_FREQUENCY / frequency);
+    timer_hz = MAX_FREQUENCY / count;
 
     // Channel=0, AccessMode=lo/hi, OperatingMode=rate-generator
     io_outb(TIMER_PORT_CMD, 0x34);
@@ -74,3 +79,15 @@ timer_disable()
     // Disable the timer interrupt (IRQ0).
     irq_disable(0);
 }
+
+uint32_t
+timer_frequency()
+{
+    return timer_hz;
+}
+
+uint64_t
+timer_ticks()
+{
+    return timer_count;
+}
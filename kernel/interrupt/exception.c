@@ -103,6 +103,12 @@ isr_breakpoint(const interrupt_context_t *context)
     tty_print(0, "Breakpoint hit.\n");
 }
 
+void
+exception_fatal(const interrupt_context_t *context)
+{
+    isr_fatal(context);
+}
+
 void
 exceptions_init()
 {
@@ -9,6 +9,7 @@
 // be found in the MonkOS LICENSE file.
 //============================================================================
 
+#include <kernel/debug/log.h>
 #include <kernel/device/keyboard.h>
 #include <kernel/device/pci.h>
 #include <kernel/device/timer.h>
@@ -16,9 +17,12 @@
 #include <kernel/interrupt/exception.h>
 #include <kernel/interrupt/interrupt.h>
 #include <kernel/mem/acpi.h>
+#include <kernel/mem/kmalloc.h>
+#include <kernel/mem/numa.h>
 #include <kernel/mem/paging.h>
 #include <kernel/mem/pmap.h>
 #include <kernel/syscall/syscall.h>
+#include <kernel/x86/cpu.h>
 #include "shell.h"
 
 #if defined(__linux__)
@@ -30,14 +34,16 @@
 void
 kmain()
 {
+    // Interrupt initialization
+    interrupts_init();
+    exceptions_init();
+
     // Memory initialization
     acpi_init();
     pmap_init();
+    numa_init();
     page_init();
-
-    // Interrupt initialization
-    interrupts_init();
-    exceptions_init();
+    kmalloc_init();
 
     // Device initialization
     tty_init();
@@ -47,6 +53,8 @@ kmain()
     // System call initialization
     syscall_init();
 
+    logf(LOG_INFO, "[main] Kernel initialized at TSC %lu.", rdtsc());
+
     // Let the games begin
     enable_interrupts();
 
@@ -22,6 +22,7 @@
 #define SIGNATURE_FADT      0x50434146           // "FACP"
 #define SIGNATURE_HPET      0x54455048           // "HPET"
 #define SIGNATURE_MCFG      0x4746434d           // "MCFG"
+#define SIGNATURE_SLIT      0x54494c53           // "SLIT"
 #define SIGNATURE_SRAT      0x54415253           // "SRAT"
 #define SIGNATURE_SSDT      0x54445353           // "SSDT"
 #define SIGNATURE_WAET      0x54454157           // "WAET"
@@ -76,6 +77,8 @@ struct acpi
     const struct acpi_fadt *fadt;
     const struct acpi_madt *madt;
     const struct acpi_mcfg *mcfg;
+    const struct acpi_srat *srat;
+    const struct acpi_slit *slit;
 };
 
 static struct acpi acpi;
@@ -101,6 +104,20 @@ read_mcfg(const struct acpi_hdr *hdr)
     acpi.mcfg = mcfg;
 }
 
+static void
+read_srat(const struct acpi_hdr *hdr)
+{
+    const struct acpi_srat *srat = (const struct acpi_srat *)hdr;
+    acpi.srat = srat;
+}
+
+static void
+read_slit(const struct acpi_hdr *hdr)
+{
+    const struct acpi_slit *slit = (const struct acpi_slit *)hdr;
+    acpi.slit = slit;
+}
+
 static void
 read_table(const struct acpi_hdr *hdr)
 {
@@ -115,6 +132,12 @@ read_table(const struct acpi_hdr *hdr)
         case SIGNATURE_MCFG:
             read_mcfg(hdr); break;
 
+        case SIGNATURE_SRAT:
+            read_srat(hdr); break;
+
+        case SIGNATURE_SLIT:
+            read_slit(hdr); break;
+
         default:
             break;
     }
@@ -366,6 +389,12 @@ acpi_madt()
     return acpi.madt;
 }
 
+const struct acpi_slit *
+acpi_slit()
+{
+    return acpi.slit;
+}
+
 static const void *
 madt_find(enum acpi_madt_type type, const void *prev)
 {
@@ -434,3 +463,54 @@ acpi_next_mcfg_addr(const struct acpi_mcfg_addr *prev)
     else
         return NULL;
 }
+
+static const void *
+srat_find(enum acpi_srat_type type, const void *prev)
+{
+    const struct acpi_srat *srat = acpi.srat;
+    if (srat == NULL)
+        return NULL;
+
+    const void *term = (const uint8_t *)srat + srat->hdr.length;
+
+    const void *ptr;
+    if (prev == NULL) {
+        ptr = srat + 1;
+    }
+    else {
+        ptr = (const uint8_t *)prev +
+              ((const struct acpi_srat_hdr *)prev)->length;
+    }
+
+    while (ptr < term) {
+        const struct acpi_srat_hdr *hdr = (const struct acpi_srat_hdr *)ptr;
+        if (hdr->length == 0)
+            break;
+        if (hdr->type == type)
+            return hdr;
+        ptr = (const uint8_t *)hdr + hdr->length;
+    }
+
+    return NULL;
+}
+
+const struct acpi_srat_local_apic *
+acpi_next_srat_local_apic(const struct acpi_srat_local_apic *prev)
+{
+    return (const struct acpi_srat_local_apic *)srat_find(
+        ACPI_SRAT_LOCAL_APIC, prev);
+}
+
+const struct acpi_srat_local_x2apic *
+acpi_next_srat_local_x2apic(const struct acpi_srat_local_x2apic *prev)
+{
+    return (const struct acpi_srat_local_x2apic *)srat_find(
+        ACPI_SRAT_LOCAL_X2APIC, prev);
+}
+
+const struct acpi_srat_memory *
+acpi_next_srat_memory(const struct acpi_srat_memory *prev)
+{
+    return (const struct acpi_srat_memory *)srat_find(
+        ACPI_SRAT_MEMORY, prev);
+}
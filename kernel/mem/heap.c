@@ -11,13 +11,38 @@
 #include <libc/string.h>
 #include <kernel/mem/heap.h>
 #include <kernel/mem/paging.h>
+#include <kernel/x86/cpu.h>
 
 // ALLOC_PAGES: The minimum number of pages to allocate each time the heap
 // is grown.
 #define ALLOC_PAGES     16
 
+// TRIM_PAGES: The number of whole free pages at the end of the heap that
+// trigger trimming. Trimming leaves ALLOC_PAGES free pages, so the heap
+// doesn't immediately need to grow again.
+#define TRIM_PAGES      (ALLOC_PAGES * 4)
+
+// MAX_HEAP_SHIFT: Log2 of the largest size a heap may grow to, which bounds
+// the sizes of its blocks.
+#define MAX_HEAP_SHIFT  32
+#define MAX_HEAP_PAGES  ((1ull << MAX_HEAP_SHIFT) / PAGE_SIZE)
+
 // block_header flags
 #define FLAG_ALLOCATED  (1 << 0)
+#define FLAG_RELEASED   (1 << 1)    // Free block's interior pages released
+
+// Free blocks are kept in segregated bins. Each first-level bin holds the
+// sizes between two powers of 2, divided linearly into second-level bins.
+// Sizes below 1 << FL_SHIFT all share the first first-level bin, in 16-byte
+// steps.
+#define SL_SHIFT        4                   // Log2 of second-level bins
+#define SL_COUNT        (1 << SL_SHIFT)     // Second-level bins per FL bin
+#define FL_SHIFT        (SL_SHIFT + 4)      // Log2 of first FL bin's limit
+#define FL_COUNT        (MAX_HEAP_SHIFT - FL_SHIFT + 1) // First-level bins
+
+// MIN_BLOCK_SIZE: The smallest block size able to hold the free list links
+// once the block is freed.
+#define MIN_BLOCK_SIZE  24
 
 // round16 returns the first value x greater than or equal to n that satisfies
 // (x mod 16) = r
@@ -35,10 +60,25 @@ struct heap
     void                 *vaddr;        // address of heap start
     uint64_t              pages;        // pages currently alloced to the heap
     uint64_t              maxpages;     // max pages used by the heap
-    struct fblock_header *first_fblock; // first free block in the heap
-    uint64_t              reserved;     // pad to a multiple of 16 bytes
+    struct heap          *next;         // next heap in the registry
+    uint64_t              allocs;       // successful heap_alloc calls
+    uint64_t              frees;        // heap_free calls
+    uint64_t              reallocs;     // heap_realloc calls
+    uint64_t              copies;       // heap_realloc calls that moved data
+    uint64_t              trimmed;      // pages trimmed from the heap's end
+    uint64_t              released;     // interior pages released
+    uint32_t              fl_bitmap;    // first-level bins holding blocks
+    uint16_t              sl_bitmap[FL_COUNT]; // second-level bins holding
+                                               // blocks, by FL bin
+    struct fblock_header *bin[FL_COUNT][SL_COUNT]; // free block lists
 };
 
+// The first block follows the heap structure, so its size must preserve the
+// 16-byte alignment of allocations.
+STATIC_ASSERT(sizeof(struct heap) % 16 == 0, "Misaligned heap structure");
+STATIC_ASSERT(sizeof(struct heap) <= PAGE_SIZE, "Heap structure spans pages");
+STATIC_ASSERT(FL_COUNT <= 32, "First-level bins don't fit the bitmap");
+
 typedef struct block_header
 {
     uint64_t size;          // size of block in bytes (minus header/footer)
@@ -53,35 +93,144 @@ typedef struct block_footer
 typedef struct fblock_header
 {
     struct block_header   block;
-    struct fblock_header *next_fblock;  // next free block in the heap
-    struct fblock_header *prev_fblock;  // prev free block in the heap
+    struct fblock_header *next_fblock;  // next free block in the bin
+    struct fblock_header *prev_fblock;  // prev free block in the bin
 } fblock_header_t;
 
+STATIC_ASSERT(MIN_BLOCK_SIZE + sizeof(block_header_t) >=
+              sizeof(fblock_header_t), "Free block links don't fit");
+
+static heap_t *heaps;   // Registry of all heaps
+
+/// Return the index of the most significant set bit.
+static inline int
+msb(uint64_t x)
+{
+    return 63 - __builtin_clzll(x);
+}
+
+/// Return the index of the least significant set bit.
+static inline int
+lsb(uint64_t x)
+{
+    return __builtin_ctzll(x);
+}
+
+/// Compute the bin holding free blocks of a given size.
+static void
+bin_index(uint64_t size, int *fl, int *sl)
+{
+    if (size < (1u << FL_SHIFT)) {
+        *fl = 0;
+        *sl = (int)(size >> 4);
+        return;
+    }
+
+    int f = msb(size);
+    *fl = f - FL_SHIFT + 1;
+    *sl = (int)(size >> (f - SL_SHIFT)) ^ SL_COUNT;
+
+    // Requests too large for the last bin search it too. No block is that
+    // large, since heaps are limited to MAX_HEAP_PAGES.
+    if (*fl >= FL_COUNT) {
+        *fl = FL_COUNT - 1;
+        *sl = SL_COUNT - 1;
+    }
+}
+
+/// Add a free block to the head of its bin's list.
+static void
+fblock_insert(heap_t *heap, fblock_header_t *fh)
+{
+    int fl, sl;
+    bin_index(fh->block.size, &fl, &sl);
+
+    fh->prev_fblock = NULL;
+    fh->next_fblock = heap->bin[fl][sl];
+    if (fh->next_fblock != NULL)
+        fh->next_fblock->prev_fblock = fh;
+    heap->bin[fl][sl] = fh;
+
+    heap->fl_bitmap     |= 1u << fl;
+    heap->sl_bitmap[fl] |= (uint16_t)(1u << sl);
+}
+
+/// Remove a free block from its bin's list.
+static void
+fblock_remove(heap_t *heap, fblock_header_t *fh)
+{
+    int fl, sl;
+    bin_index(fh->block.size, &fl, &sl);
+
+    if (fh->prev_fblock != NULL)
+        fh->prev_fblock->next_fblock = fh->next_fblock;
+    else
+        heap->bin[fl][sl] = fh->next_fblock;
+    if (fh->next_fblock != NULL)
+        fh->next_fblock->prev_fblock = fh->prev_fblock;
+
+    if (heap->bin[fl][sl] == NULL) {
+        heap->sl_bitmap[fl] &= (uint16_t)~(1u << sl);
+        if (heap->sl_bitmap[fl] == 0)
+            heap->fl_bitmap &= ~(1u << fl);
+    }
+}
+
+/// Return the block size used to hold an allocation of 'size' bytes. Sizes
+/// are rounded up to the nearest (mod 16) == 8 value, so that all returned
+/// pointers remain aligned on 16-byte boundaries.
+static inline uint64_t
+block_size(uint64_t size)
+{
+    return round16(max(size, MIN_BLOCK_SIZE), 16 - sizeof(block_footer_t));
+}
+
+/// Update a block's footer to match the size in its header.
+static void
+update_footer(block_header_t *bh)
+{
+    block_footer_t *bf = ptr_add(block_footer_t, bh, bh->size +
+                                 sizeof(block_header_t));
+    bf->size = bh->size;
+}
+
 heap_t *
 heap_create(pagetable_t *pt, void *vaddr, uint64_t maxpages)
 {
-    heap_t *heap = (heap_t *)page_alloc(pt, vaddr, ALLOC_PAGES);
-    heap->pt           = pt;
-    heap->vaddr        = vaddr;
-    heap->pages        = ALLOC_PAGES;
-    heap->maxpages     = max(ALLOC_PAGES, maxpages);
-    heap->first_fblock = (fblock_header_t *)(heap + 1);
-    heap->reserved     = 0;
-
-    uint64_t block_size = heap->pages * PAGE_SIZE -
-                          sizeof(heap_t) -
-                          sizeof(block_header_t) -
-                          sizeof(block_footer_t);
-
-    fblock_header_t *fh = heap->first_fblock;
-    fh->block.size  = block_size;
+    // Heaps without a page table occupy memory that's already mapped.
+    heap_t *heap = (heap_t *)vaddr;
+    if (pt != NULL)
+        page_reserve(pt, vaddr, ALLOC_PAGES);
+
+    heap->pt       = pt;
+    heap->vaddr    = vaddr;
+    heap->pages    = ALLOC_PAGES;
+    heap->maxpages = min(max(ALLOC_PAGES, maxpages), MAX_HEAP_PAGES);
+    heap->allocs   = 0;
+    heap->frees    = 0;
+    heap->reallocs = 0;
+    heap->copies   = 0;
+    heap->trimmed  = 0;
+    heap->released = 0;
+
+    // Start with every bin empty.
+    heap->fl_bitmap = 0;
+    memzero(heap->sl_bitmap, sizeof(heap->sl_bitmap));
+    memzero(heap->bin, sizeof(heap->bin));
+
+    // Initialize the first free block, which fills the rest of the pages.
+    fblock_header_t *fh = (fblock_header_t *)(heap + 1);
+    fh->block.size  = heap->pages * PAGE_SIZE -
+                      sizeof(heap_t) -
+                      sizeof(block_header_t) -
+                      sizeof(block_footer_t);
     fh->block.flags = 0;
-    fh->next_fblock = NULL;
-    fh->prev_fblock = NULL;
+    update_footer(&fh->block);
+    fblock_insert(heap, fh);
 
-    block_footer_t *footer = ptr_add(block_footer_t, fh, block_size +
-                                     sizeof(block_header_t));
-    footer->size = block_size;
+    // Add the heap to the registry.
+    heap->next = heaps;
+    heaps      = heap;
 
     return heap;
 }
@@ -89,7 +238,15 @@ heap_create(pagetable_t *pt, void *vaddr, uint64_t maxpages)
 void
 heap_destroy(heap_t *heap)
 {
-    page_free(heap->pt, heap->vaddr, heap->pages);
+    for (heap_t **h = &heaps; *h != NULL; h = &(*h)->next) {
+        if (*h == heap) {
+            *h = heap->next;
+            break;
+        }
+    }
+
+    if (heap->pt != NULL)
+        page_free(heap->pt, heap->vaddr, heap->pages);
     // The heap pointer now points to unpaged memory.
 }
 
@@ -119,51 +276,66 @@ prev_fblock_adj(heap_t *heap, block_header_t *bh)
         return NULL;
     block_footer_t *bf = ptr_sub(block_footer_t, bh,
                                  sizeof(block_footer_t));
-    block_header_t *prev = ptr_sub(block_header_t, bf, total_bytes(bf));
+    block_header_t *prev = ptr_sub(block_header_t, bh, total_bytes(bf));
     if ((prev->flags & FLAG_ALLOCATED) == 0)
         return (fblock_header_t *)prev;
     return NULL;
 }
 
-/// Scan all blocks after 'b' until a free block is encountered and return it.
-/// If no free blocks are found, return NULL.
-static fblock_header_t *
-next_fblock(heap_t *heap, block_header_t *bh)
+/// Release the whole pages of a free block that overlap the range [lo, hi),
+/// leaving them reserved so they're refilled with zeroed frames when the
+/// block is next used. The pages holding the block's links and footer are
+/// never released. Return the number of pages released.
+static uint64_t
+release_pages(heap_t *heap, fblock_header_t *fh, uint64_t lo, uint64_t hi)
 {
-    block_header_t *term = ptr_add(block_header_t, heap->vaddr,
-                                   heap->pages * PAGE_SIZE);
-    for (;;) {
-        bh = ptr_add(block_header_t, bh, total_bytes(bh));
-        if (bh >= term)
-            return NULL;
-        if ((bh->flags & FLAG_ALLOCATED) == 0)
-            return (fblock_header_t *)bh;
-    }
-    return NULL;
+    uint64_t first = max(align_up((uint64_t)(fh + 1), PAGE_SIZE),
+                         lo & ~(PAGE_SIZE - 1));
+    uint64_t term  = min(((uint64_t)fh + sizeof(block_header_t) +
+                          fh->block.size) & ~(PAGE_SIZE - 1),
+                         align_up(hi, PAGE_SIZE));
+    if (term <= first)
+        return 0;
+
+    uint64_t pages = (term - first) / PAGE_SIZE;
+    page_free(heap->pt, (void *)first, (int)pages);
+    page_reserve(heap->pt, (void *)first, (int)pages);
+    heap->released += pages;
+    return pages;
 }
 
-/// Scan all blocks preceding 'b' until a free block is encountered and return
-/// it. If no free blocks are found, return NULL.
-static fblock_header_t *
-prev_fblock(heap_t *heap, block_header_t *bh)
+/// Merge a free block with the free block following it. Neither block may
+/// be in a bin. If either block's pages were released, the pages of the
+/// merged block that weren't are released too, so the merged block remains
+/// released and later allocations never count on frames it doesn't have.
+static void
+merge_fblocks(heap_t *heap, fblock_header_t *fh, fblock_header_t *fhn)
 {
-    block_header_t *first = ptr_add(block_header_t, heap->vaddr,
-                                    sizeof(heap_t));
-    for (;;) {
-        if (bh == first)
-            return NULL;
-        block_footer_t *bf = ptr_sub(block_footer_t, bh,
-                                     sizeof(block_footer_t));
-        bh = ptr_sub(block_header_t, bh, total_bytes(bf));
-        if ((bh->flags & FLAG_ALLOCATED) == 0)
-            return (fblock_header_t *)bh;
-    }
-    return NULL;
+    uint64_t flags = (fh->block.flags | fhn->block.flags) & FLAG_RELEASED;
+
+    // Find the part of the merged block whose pages weren't released. The
+    // pages holding the boundary tags between the blocks never were.
+    uint64_t lo = (fh->block.flags & FLAG_RELEASED)
+                  ? (uint64_t)fhn - sizeof(block_footer_t) : (uint64_t)fh;
+    uint64_t hi = (fhn->block.flags & FLAG_RELEASED)
+                  ? (uint64_t)(fhn + 1)
+                  : (uint64_t)fhn + total_bytes(&fhn->block);
+
+    fh->block.size += total_bytes(&fhn->block);
+    fh->block.flags = flags;
+    update_footer(&fh->block);
+    if (flags)
+        release_pages(heap, fh, lo, hi);
 }
 
 /// Grow the heap so that it's big enough to hold at least minsize newly
 /// allocated bytes (not including headers). Return a pointer to the
-/// first new free block if successful. Otherwise return NULL.
+/// free block at the end of the heap, which is left out of the bins, if
+/// successful. Otherwise return NULL.
+///
+/// The new pages are only reserved, so they count as released. A block
+/// made of them alone is released, and so is a released last block that
+/// absorbs them.
 static fblock_header_t *
 grow_heap(heap_t *heap, uint64_t minsize)
 {
@@ -178,10 +350,11 @@ grow_heap(heap_t *heap, uint64_t minsize)
             return NULL;
     }
 
-    // Compute the virtual address of the next group of pages and allocate
-    // them from the page table.
+    // Compute the virtual address of the next group of pages and reserve
+    // them in the page table. Frames are allocated as the pages are touched.
     void *vnext = ptr_add(void, heap->vaddr, heap->pages * PAGE_SIZE);
-    page_alloc(heap->pt, vnext, pages);
+    if (heap->pt != NULL)
+        page_reserve(heap->pt, vnext, pages);
     heap->pages += pages;
 
     // Examine the last block in the heap to see if it's free.
@@ -197,196 +370,486 @@ grow_heap(heap_t *heap, uint64_t minsize)
         fh             = (fblock_header_t *)vnext;
         fh->block.size = pages * PAGE_SIZE - sizeof(block_header_t) -
                          sizeof(block_footer_t);
-        fh->block.flags = 0;
-        fh->next_fblock = NULL;
-        fh->prev_fblock = prev_fblock(heap, (block_header_t *)vnext);
-        if (fh->prev_fblock == NULL)
-            heap->first_fblock = fh;
+        fh->block.flags = (heap->pt != NULL) ? FLAG_RELEASED : 0;
+        update_footer(&fh->block);
     }
 
-    // If the last block in the old heap was free, merge it with the newly
-    // allocated pages.
+    // If the last block in the old heap was free, take it out of its bin
+    // and merge it with the newly allocated pages. If it was released, the
+    // page that held its footer is released too.
     else {
-        fh              = (fblock_header_t *)lh;
+        fh = (fblock_header_t *)lh;
+        fblock_remove(heap, fh);
         fh->block.size += pages * PAGE_SIZE;
+        update_footer(&fh->block);
+        if (fh->block.flags & FLAG_RELEASED)
+            release_pages(heap, fh, (uint64_t)vnext - sizeof(block_footer_t),
+                          (uint64_t)vnext);
     }
 
-    // Update the free block footer.
-    block_footer_t *ff = ptr_add(block_footer_t, fh, fh->block.size +
-                                 sizeof(block_header_t));
-    ff->size = fh->block.size;
-
     return fh;
 }
 
-// Find a free block large enough to hold 'size' bytes. If such a block is not
-// found, grow the heap and try again.
+/// If a free block is the last block in the heap and holds enough whole
+/// pages, return its trailing pages to the page table.
+static void
+trim_heap(heap_t *heap, fblock_header_t *fh)
+{
+    // Heaps without a page table can't return their pages.
+    if (heap->pt == NULL)
+        return;
+
+    uint64_t term = (uint64_t)heap->vaddr + heap->pages * PAGE_SIZE;
+    if ((uint64_t)fh + total_bytes(&fh->block) != term)
+        return;
+
+    // Keep the block's links, a minimal block and ALLOC_PAGES more pages.
+    uint64_t keep = align_up((uint64_t)fh + sizeof(block_header_t) +
+                             MIN_BLOCK_SIZE + sizeof(block_footer_t),
+                             PAGE_SIZE) + ALLOC_PAGES * PAGE_SIZE;
+    if (keep >= term)
+        return;
+    uint64_t pages = min((term - keep) / PAGE_SIZE,
+                         heap->pages - ALLOC_PAGES);
+    if (pages < TRIM_PAGES)
+        return;
+
+    heap->pages    -= pages;
+    heap->trimmed  += pages;
+    fh->block.size -= pages * PAGE_SIZE;
+    update_footer(&fh->block);
+    page_free(heap->pt, ptr_add(void, heap->vaddr, heap->pages * PAGE_SIZE),
+              (int)pages);
+}
+
+/// Find a free block large enough to hold 'size' bytes, and remove it from
+/// its bin. If such a block is not found, grow the heap.
 static fblock_header_t *
 find_fblock(heap_t *heap, uint64_t size)
 {
-    fblock_header_t *fh = heap->first_fblock;
-    while (fh) {
-        if (fh->block.size >= size)
+    // Round the size up to the next bin boundary, so that every block in
+    // the bin (and all larger bins) is large enough.
+    uint64_t search = size;
+    if (search >= (1u << FL_SHIFT))
+        search += (1ull << (msb(search) - SL_SHIFT)) - 1;
+
+    int fl, sl;
+    bin_index(search, &fl, &sl);
+
+    // Look for a non-empty bin at the same first level, and then for the
+    // smallest non-empty bin at a higher first level.
+    uint64_t slmap = heap->sl_bitmap[fl] & (~0ull << sl);
+    if (slmap == 0) {
+        uint64_t flmap = heap->fl_bitmap & (~0ull << (fl + 1));
+        if (flmap != 0) {
+            fl    = lsb(flmap);
+            slmap = heap->sl_bitmap[fl];
+        }
+    }
+
+    // A request too large for every bin searches the last one, so the
+    // block found may still be too small.
+    if (slmap != 0) {
+        fblock_header_t *fh = heap->bin[fl][lsb(slmap)];
+        if (fh->block.size >= size) {
+            fblock_remove(heap, fh);
             return fh;
-        fh = fh->next_fblock;
+        }
     }
 
     // No free blocks large enough were found, so grow the heap.
     return grow_heap(heap, size);
 }
 
+/// Shrink an allocated block to 'size' bytes if the excess can hold a free
+/// block. The excess becomes a free block following the allocated block,
+/// merged with the next block if it's free. If the block would be filled
+/// (or nearly filled) by 'size' bytes, its size remains unchanged. The
+/// excess is released if 'released' is FLAG_RELEASED, which it should be
+/// when the excess was carved from a released free block.
+static void
+split_block(heap_t *heap, block_header_t *bh, uint64_t size,
+            uint64_t released)
+{
+    if (bh->size - size < MIN_BLOCK_SIZE + sizeof(block_header_t) +
+        sizeof(block_footer_t))
+        return;
+
+    uint64_t bsize = bh->size;
+    bh->size = size;
+    update_footer(bh);
+
+    fblock_header_t *rh = ptr_add(fblock_header_t, bh, total_bytes(bh));
+    rh->block.size  = bsize - size - sizeof(block_header_t) -
+                      sizeof(block_footer_t);
+    rh->block.flags = released;
+
+    update_footer(&rh->block);
+
+    fblock_header_t *fhn = next_fblock_adj(heap, &rh->block);
+    if (fhn != NULL) {
+        fblock_remove(heap, fhn);
+        merge_fblocks(heap, rh, fhn);
+    }
+
+    trim_heap(heap, rh);
+    fblock_insert(heap, rh);
+}
+
+/// Return true if a block is the last block in the heap.
+static bool
+is_last_block(const heap_t *heap, const block_header_t *bh)
+{
+    return (uint64_t)bh + total_bytes(bh) ==
+           (uint64_t)heap->vaddr + heap->pages * PAGE_SIZE;
+}
+
 void *
 heap_alloc(heap_t *heap, uint64_t size)
 {
-    // Round the size up to the nearest (mod 16) == 8 value. This way all
-    // returned pointers will remain aligned on 16-byte boundaries.
-    size = round16(size, 16 - sizeof(block_footer_t));
+    size = block_size(size);
 
     // Find a free block big enough to hold the allocation
     fblock_header_t *fh = find_fblock(heap, size);
     if (fh == NULL)
         return NULL;
 
-    // Copy the original free block's size and pointers, since we'll be
-    // modifying their current storage.
-    uint64_t         fsize = fh->block.size;
-    fblock_header_t *next  = fh->next_fblock;
-    fblock_header_t *prev  = fh->prev_fblock;
-
-    // If the free block would be filled (or nearly filled) by the
-    // allocation, replace it with an allocated block.
-    block_header_t *ah;
-    if (fsize - size < 8 + sizeof(block_header_t) + sizeof(block_footer_t)) {
-
-        // Mark the block header as allocated, leaving the size unchanged.
-        ah        = &fh->block;
-        ah->flags = FLAG_ALLOCATED;
-
-        // Ignore the allocated block footer, since the size remains
-        // unchanged.
-
-        // Fix up the free list.
-        if (prev)
-            prev->next_fblock = next;
-        else
-            heap->first_fblock = next;
-        if (next)
-            next->prev_fblock = prev;
+    // Mark the free block allocated, and split off any excess as a smaller
+    // free block.
+    block_header_t *ah       = &fh->block;
+    uint64_t        released = ah->flags & FLAG_RELEASED;
+    ah->flags = FLAG_ALLOCATED;
+    split_block(heap, ah, size, released);
+
+    // Return a pointer just beyond the allocated block header.
+    heap->allocs++;
+    return ptr_add(void, ah, sizeof(block_header_t));
+}
+
+void *
+heap_alloc_aligned(heap_t *heap, uint64_t size, uint64_t align)
+{
+    if (align & (align - 1))
+        fatal();
+    if (align <= 16)
+        return heap_alloc(heap, size);
+
+    // Find a free block big enough to hold the allocation at any alignment,
+    // plus a minimal free block to hold the leading slack.
+    size = block_size(size);
+    uint64_t lead_min = sizeof(block_header_t) + MIN_BLOCK_SIZE +
+                        sizeof(block_footer_t);
+    fblock_header_t *fh = find_fblock(heap, size + align + lead_min);
+    if (fh == NULL)
+        return NULL;
+
+    // Locate the first aligned pointer that leaves either no leading slack
+    // or enough to form a free block.
+    uint64_t start = (uint64_t)fh + sizeof(block_header_t);
+    uint64_t ptr   = align_up(start, align);
+    if (ptr != start && ptr - start < lead_min)
+        ptr += align;
+
+    // Return the leading slack to the heap as a free block. The block
+    // preceding it is never free, since free blocks are always merged.
+    // Both the slack and any trailing excess keep the free block's
+    // released state.
+    block_header_t *ah       = &fh->block;
+    uint64_t        released = fh->block.flags & FLAG_RELEASED;
+    if (ptr != start) {
+        uint64_t lead = ptr - start;
+        ah        = ptr_add(block_header_t, fh, lead);
+        ah->size  = fh->block.size - lead;
+
+        fh->block.size  = lead - sizeof(block_header_t) -
+                          sizeof(block_footer_t);
+        fh->block.flags = released;
+        update_footer(&fh->block);
+        fblock_insert(heap, fh);
     }
 
-    // Otherwise, split the free block into an allocated block and a smaller
-    // free block.
-    else {
+    // Mark the aligned block allocated, and split off any trailing excess.
+    ah->flags = FLAG_ALLOCATED;
+    update_footer(ah);
+    split_block(heap, ah, size, released);
 
-        // Initialize the allocated block header.
-        ah        = &fh->block;
-        ah->size  = size;
-        ah->flags = FLAG_ALLOCATED;
+    heap->allocs++;
+    return (void *)ptr;
+}
 
-        // Initialize the allocated block footer.
-        block_footer_t *af = ptr_add(block_footer_t, ah, size +
-                                     sizeof(block_header_t));
-        af->size = size;
+void *
+heap_realloc(heap_t *heap, void *ptr, uint64_t size)
+{
+    if (ptr == NULL)
+        return heap_alloc(heap, size);
+    if (size == 0) {
+        heap_free(heap, ptr);
+        return NULL;
+    }
 
-        // Initialize the new free block header, which follows the allocated
-        // block.
-        fblock_header_t *fh = (fblock_header_t *)(af + 1);
-        fh->block.size = fsize - size - sizeof(block_header_t) -
-                         sizeof(block_footer_t);
-        fh->block.flags = 0;
-
-        // Initialize the new free block footer.
-        block_footer_t *ff = ptr_add(block_footer_t, fh, fh->block.size +
-                                     sizeof(block_header_t));
-        ff->size = fh->block.size;
-
-        // Fix up the free list.
-        fh->prev_fblock = prev;
-        fh->next_fblock = next;
-        if (prev)
-            prev->next_fblock = fh;
-        else
-            heap->first_fblock = fh;
-        if (next)
-            next->prev_fblock = fh;
+    block_header_t *bh       = ptr_sub(block_header_t, ptr,
+                                       sizeof(block_header_t));
+    uint64_t        bsize    = block_size(size);
+    uint64_t        released = 0;
+    heap->reallocs++;
+
+    if (bsize > bh->size) {
+        // Try to grow the block in place, first into the following block if
+        // it's free, and then into newly added pages if the block (or the
+        // free block following it) ends the heap. The excess lies within the
+        // free block grown into, so it keeps that block's released state.
+        fblock_header_t *fhn   = next_fblock_adj(heap, bh);
+        uint64_t         avail = bh->size;
+        if (fhn != NULL)
+            avail += total_bytes(&fhn->block);
+
+        if (avail >= bsize) {
+            fblock_remove(heap, fhn);
+            bh->size = avail;
+            released = fhn->block.flags & FLAG_RELEASED;
+        }
+        else if (is_last_block(heap, fhn != NULL ? &fhn->block : bh)) {
+            fblock_header_t *gh = grow_heap(heap, bsize - avail);
+            if (gh != NULL) {
+                bh->size += total_bytes(&gh->block);
+                released = gh->block.flags & FLAG_RELEASED;
+            }
+        }
+
+        // Otherwise, move the allocation to a new block.
+        if (bh->size < bsize) {
+            void *nptr = heap_alloc(heap, size);
+            if (nptr == NULL)
+                return NULL;
+            memcpy(nptr, ptr, bh->size);
+            heap_free(heap, ptr);
+            heap->copies++;
+            return nptr;
+        }
+        update_footer(bh);
     }
 
-    // Return a pointer just beyond the allocated block header.
-    return ptr_add(void, ah, sizeof(block_header_t));
+    // Return any excess beyond the new size to the heap.
+    split_block(heap, bh, bsize, released);
+    return ptr;
 }
 
 void
 heap_free(heap_t *heap, void *ptr)
 {
     block_header_t *h = ptr_sub(block_header_t, ptr, sizeof(block_header_t));
+    heap->frees++;
 
-    // Check if adjacent blocks are free.
+    // Merge the block with its adjacent blocks if they're free, using the
+    // boundary tags to find them.
+    fblock_header_t *fh  = (fblock_header_t *)h;
     fblock_header_t *fhp = prev_fblock_adj(heap, h);
     fblock_header_t *fhn = next_fblock_adj(heap, h);
+    fh->block.flags = 0;
 
-    // If both adjacent blocks are free, merge all three into a single
-    // free block.
-    if (fhp && fhn) {
-        fhp->block.size += h->size + 2 * sizeof(block_header_t) +
-                           2 * sizeof(block_footer_t) + fhn->block.size;
+    if (fhp != NULL) {
+        fblock_remove(heap, fhp);
+        merge_fblocks(heap, fhp, fh);
+        fh = fhp;
+    }
+    if (fhn != NULL) {
+        fblock_remove(heap, fhn);
+        merge_fblocks(heap, fh, fhn);
+    }
 
-        fhp->next_fblock = fhn->next_fblock;
-        if (fhn->next_fblock != NULL)
-            fhn->next_fblock->prev_fblock = fhp;
+    trim_heap(heap, fh);
+    fblock_insert(heap, fh);
+}
 
-        block_footer_t *ffp = ptr_add(block_footer_t, fhp, fhp->block.size +
-                                      sizeof(block_header_t));
-        ffp->size = fhp->block.size;
+uint64_t
+heap_release_unused(heap_t *heap)
+{
+    if (heap->pt == NULL)
+        return 0;
+
+    uint64_t released = 0;
+    uint64_t flmap    = heap->fl_bitmap;
+    while (flmap != 0) {
+        int fl = lsb(flmap);
+        flmap &= flmap - 1;
+
+        uint64_t slmap = heap->sl_bitmap[fl];
+        while (slmap != 0) {
+            int sl = lsb(slmap);
+            slmap &= slmap - 1;
+
+            for (fblock_header_t *fh = heap->bin[fl][sl]; fh != NULL;
+                 fh = fh->next_fblock) {
+                if (fh->block.flags & FLAG_RELEASED)
+                    continue;
+                fh->block.flags |= FLAG_RELEASED;
+                released += release_pages(heap, fh, (uint64_t)fh,
+                                          (uint64_t)fh +
+                                          total_bytes(&fh->block));
+            }
+        }
     }
+    return released;
+}
 
-    // If only the previous adjacent block is free, merge it with the newly
-    // free block.
-    else if (fhp && !fhn) {
-        fhp->block.size += total_bytes(h);
-        block_footer_t *ffp = ptr_add(block_footer_t, fhp, fhp->block.size +
-                                      sizeof(block_header_t));
-        ffp->size = fhp->block.size;
+heap_t *
+heap_next(const heap_t *prev)
+{
+    return (prev == NULL) ? heaps : prev->next;
+}
+
+/// Return the block following 'bh' (or the first block, if 'bh' is NULL)
+/// if it lies entirely within the heap. Otherwise return NULL.
+static const block_header_t *
+next_block(const heap_t *heap, const block_header_t *bh)
+{
+    uint64_t addr = (bh == NULL) ? (uint64_t)(heap + 1)
+                    : (uint64_t)bh + total_bytes(bh);
+    uint64_t term = (uint64_t)heap->vaddr + heap->pages * PAGE_SIZE;
+    if (addr >= term ||
+        term - addr < sizeof(block_header_t) + sizeof(block_footer_t))
+        return NULL;
+
+    const block_header_t *next = (const block_header_t *)addr;
+    if (next->size > term - addr - sizeof(block_header_t) -
+        sizeof(block_footer_t))
+        return NULL;
+    return next;
+}
+
+bool
+heap_walk(const heap_t *heap, heapblock_t *block)
+{
+    const block_header_t *bh = NULL;
+    if (block->ptr != NULL)
+        bh = ptr_sub(const block_header_t, block->ptr,
+                     sizeof(block_header_t));
+
+    bh = next_block(heap, bh);
+    if (bh == NULL)
+        return false;
+
+    block->ptr       = ptr_add(void, bh, sizeof(block_header_t));
+    block->size      = bh->size;
+    block->allocated = (bh->flags & FLAG_ALLOCATED) != 0;
+    return true;
+}
+
+const void *
+heap_check(const heap_t *heap)
+{
+    // Walk the blocks, checking each one's boundary tags. Free blocks must
+    // never be adjacent, since they're always merged.
+    uint64_t term   = (uint64_t)heap->vaddr + heap->pages * PAGE_SIZE;
+    uint64_t fcount = 0;
+    bool     pfree  = false;
+
+    const block_header_t *bh = NULL;
+    for (;;) {
+        const block_header_t *next = next_block(heap, bh);
+        if (next == NULL)
+            break;
+        bh = next;
+
+        const block_footer_t *bf = ptr_add(const block_footer_t, bh,
+                                           sizeof(block_header_t) + bh->size);
+        bool isfree = (bh->flags & FLAG_ALLOCATED) == 0;
+        if (bh->size < MIN_BLOCK_SIZE || bh->size % 16 != 8 ||
+            bf->size != bh->size ||
+            (bh->flags & ~(FLAG_ALLOCATED | FLAG_RELEASED)) != 0 ||
+            (!isfree && (bh->flags & FLAG_RELEASED)) ||
+            (isfree && pfree))
+            return bh;
+
+        fcount += isfree;
+        pfree   = isfree;
     }
 
-    // If only the next adjacent block is free, merge it with the newly free
-    // block.
-    else if (fhn && !fhp) {
-        fblock_header_t *fh = (fblock_header_t *)h;
-        fh->block.size += total_bytes(&fhn->block);
-        fh->block.flags = 0;
-
-        fh->prev_fblock = fhn->prev_fblock;
-        if (fh->prev_fblock == NULL)
-            heap->first_fblock = fh;
-        else
-            fh->prev_fblock->next_fblock = fh;
-
-        fh->next_fblock = fhn->next_fblock;
-        if (fh->next_fblock != NULL)
-            fh->next_fblock->prev_fblock = fh;
-
-        block_footer_t *ff = ptr_add(block_footer_t, fh, fh->block.size +
-                                     sizeof(block_header_t));
-        ff->size = fh->block.size;
+    // The last block must end the heap exactly.
+    uint64_t end = (bh == NULL) ? (uint64_t)(heap + 1)
+                   : (uint64_t)bh + total_bytes(bh);
+    if (end != term)
+        return (const void *)end;
+
+    // Every free block must be in the bin matching its size, with links
+    // and bitmaps that agree with the bins' contents. Problems here are
+    // reported as corruption of the heap structure.
+    uint64_t bcount = 0;
+    for (int fl = 0; fl < FL_COUNT; fl++) {
+        for (int sl = 0; sl < SL_COUNT; sl++) {
+            bool full = heap->bin[fl][sl] != NULL;
+            if (full != ((heap->sl_bitmap[fl] >> sl) & 1))
+                return heap;
+
+            const fblock_header_t *prev = NULL;
+            for (const fblock_header_t *fh = heap->bin[fl][sl]; fh != NULL;
+                 fh = fh->next_fblock) {
+                if ((uint64_t)fh < (uint64_t)(heap + 1) ||
+                    (uint64_t)fh >= term || ++bcount > fcount)
+                    return heap;
+
+                int bfl, bsl;
+                bin_index(fh->block.size, &bfl, &bsl);
+                if ((fh->block.flags & FLAG_ALLOCATED) ||
+                    fh->prev_fblock != prev || bfl != fl || bsl != sl)
+                    return fh;
+                prev = fh;
+            }
+        }
+        if ((heap->sl_bitmap[fl] != 0) != ((heap->fl_bitmap >> fl) & 1))
+            return heap;
     }
+    if (bcount != fcount)
+        return heap;
 
-    // If neither adjacent block is free, convert the block into a single
-    // free block.
-    else {
-        fblock_header_t *fh = (fblock_header_t *)h;
-        fh->block.flags = 0;
-
-        fh->next_fblock = next_fblock(heap, h);
-        if (fh->next_fblock == NULL)
-            fh->prev_fblock = prev_fblock(heap, h);
-        else {
-            fh->prev_fblock              = fh->next_fblock->prev_fblock;
-            fh->next_fblock->prev_fblock = fh;
+    return NULL;
+}
+
+void
+heap_stats(const heap_t *heap, heapstats_t *stats)
+{
+    memzero(stats, sizeof(heapstats_t));
+    stats->vaddr    = heap->vaddr;
+    stats->pages    = heap->pages;
+    stats->maxpages = heap->maxpages;
+    stats->allocs   = heap->allocs;
+    stats->frees    = heap->frees;
+    stats->reallocs = heap->reallocs;
+    stats->copies   = heap->copies;
+    stats->trimmed  = heap->trimmed;
+    stats->released = heap->released;
+
+    // The heap structure occupies the first page.
+    uint64_t lastpage = (uint64_t)heap->vaddr / PAGE_SIZE;
+    stats->used_pages = 1;
+    stats->overhead   = sizeof(heap_t);
+
+    // Walk every block in the heap, tallying allocated and free bytes.
+    heapblock_t block = { .ptr = NULL };
+    while (heap_walk(heap, &block)) {
+        stats->overhead += sizeof(block_header_t) + sizeof(block_footer_t);
+
+        if (!block.allocated) {
+            stats->free_blocks++;
+            stats->free_bytes  += block.size;
+            stats->largest_free = max(stats->largest_free, block.size);
+            int bucket = msb(block.size) - HEAP_HIST_SHIFT;
+            bucket = max(bucket, 0);
+            bucket = min(bucket, HEAP_HIST_BUCKETS - 1);
+            stats->free_hist[bucket]++;
+            continue;
         }
 
-        if (fh->prev_fblock == NULL)
-            heap->first_fblock = fh;
-        else
-            fh->prev_fblock->next_fblock = fh;
+        stats->used_blocks++;
+        stats->used_bytes += block.size;
+
+        // Count the pages holding allocated blocks, including their tags.
+        // Consecutive blocks may share a page.
+        uint64_t first = ((uint64_t)block.ptr - sizeof(block_header_t)) /
+                         PAGE_SIZE;
+        uint64_t last  = ((uint64_t)block.ptr + block.size +
+                          sizeof(block_footer_t) - 1) / PAGE_SIZE;
+        stats->used_pages += last - first + 1 - (first == lastpage);
+        lastpage = last;
     }
 }
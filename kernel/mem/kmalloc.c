@@ -0,0 +1,370 @@
+//============================================================================
+/// @file       kmalloc.c
+/// @brief      General-purpose kernel memory allocator.
+//
+//  Copyright 2016 Brett Vickers.
+//  Use of this source code is governed by a BSD-style license
+//  that can be found in the MonkOS LICENSE file.
+//============================================================================
+
+#include <core.h>
+#include <libc/string.h>
+#include <kernel/debug/log.h>
+#include <kernel/mem/heap.h>
+#include <kernel/mem/kmalloc.h>
+#include <kernel/mem/paging.h>
+#include <kernel/x86/cpu.h>
+
+// Region constants
+#define SLAB_ORDER       PFORDER_LARGE          // Order of the slab region
+#define SLAB_PAGES       (1 << SLAB_ORDER)      // Pages in the slab region
+#define ARENA_ORDER      (PFORDER_LARGE + 1)    // Order of an arena region
+#define ARENA_PAGES      (1 << ARENA_ORDER)     // Pages in an arena region
+
+// Slab constants
+#define SLAB_NONE        0xffff                 // Invalid slab index
+#define SLAB_UNUSED      0xff                   // Class of an unused slab
+
+STATIC_ASSERT(SLAB_PAGES < SLAB_NONE, "Slab indices don't fit");
+STATIC_ASSERT(KMALLOC_MIN_SIZE << (KMALLOC_CLASSES - 1) == KMALLOC_MAX_SIZE,
+              "Size classes don't cover the slab sizes");
+
+/// A slab is a page of the slab region holding objects of one size class.
+/// Slab records are kept apart from the slab pages, so an object's cache
+/// lines hold nothing but the object. The objects of a slab that aren't in
+/// use are linked through their first 8 bytes.
+struct slab
+{
+    void    *free;          ///< First free object, or NULL if the slab is full
+    uint16_t next;          ///< Next slab on the partial or unused list
+    uint16_t prev;          ///< Prev slab on the partial list
+    uint16_t inuse;         ///< Objects in use
+    uint8_t  sclass;        ///< Size class, or SLAB_UNUSED
+};
+
+/// An arena is a per-CPU heap serving the large allocations made by its
+/// CPU, so that CPUs never share a heap's free lists. Allocations freed by
+/// other CPUs are pushed onto the arena's remote-free list, which its owner
+/// drains before allocating. The list is only ever pushed to or taken as a
+/// whole, so it's safe without locks.
+struct arena
+{
+    heap_t          *heap;          ///< Arena's heap, NULL until first used
+    uint8_t         *base;          ///< First byte of the arena region
+    uint64_t         allocs;        ///< Allocations made from the arena
+    uint64_t         frees;         ///< Allocations returned by the owner
+    uint64_t         drains;        ///< Non-empty remote-free lists drained
+    _Atomic(void *)  remote CACHEALIGN; ///< Head of the remote-free list
+    atomic_ulong     remote_frees;  ///< Allocations freed by other CPUs
+} CACHEALIGN;
+
+struct kmalloc
+{
+    uint8_t    *slabbase;                  // First byte of the slab region
+    uint16_t    unused;                    // Head of the unused slab list
+    uint16_t    untouched;                 // First slab never assigned
+    uint16_t    partial[KMALLOC_CLASSES];  // Slabs with free objects
+    uint64_t    allocs;                    // Successful kmalloc calls
+    uint64_t    frees;                     // kfree calls
+    struct slab slab[SLAB_PAGES];          // Indexed by slab page
+};
+
+static struct kmalloc km;
+static struct arena   arena[MAX_CPUS];     // Indexed by CPU
+
+/// Return the size class holding allocations of a given size.
+static inline int
+size_class(uint64_t size)
+{
+    if (size <= KMALLOC_MIN_SIZE)
+        return 0;
+    return 64 - __builtin_clzll(size - 1) - 3;
+}
+
+static inline uint64_t
+class_size(int sclass)
+{
+    return (uint64_t)KMALLOC_MIN_SIZE << sclass;
+}
+
+static inline void *
+slab_page(uint16_t s)
+{
+    return km.slabbase + (uint64_t)s * PAGE_SIZE;
+}
+
+static void
+partial_insert(int sclass, uint16_t s)
+{
+    struct slab *sl = &km.slab[s];
+    sl->prev = SLAB_NONE;
+    sl->next = km.partial[sclass];
+    if (sl->next != SLAB_NONE)
+        km.slab[sl->next].prev = s;
+    km.partial[sclass] = s;
+}
+
+static void
+partial_remove(int sclass, uint16_t s)
+{
+    struct slab *sl = &km.slab[s];
+    if (sl->prev != SLAB_NONE)
+        km.slab[sl->prev].next = sl->next;
+    else
+        km.partial[sclass] = sl->next;
+    if (sl->next != SLAB_NONE)
+        km.slab[sl->next].prev = sl->prev;
+}
+
+/// Assign an unused slab page to a size class, and link its objects into
+/// the slab's free list. Return the slab's index, or SLAB_NONE if the slab
+/// region is exhausted.
+static uint16_t
+slab_create(int sclass)
+{
+    uint16_t s;
+    if (km.unused != SLAB_NONE) {
+        s         = km.unused;
+        km.unused = km.slab[s].next;
+    }
+    else if (km.untouched < SLAB_PAGES) {
+        s = km.untouched++;
+    }
+    else {
+        return SLAB_NONE;
+    }
+
+    uint64_t size  = class_size(sclass);
+    uint8_t *first = (uint8_t *)slab_page(s);
+    uint8_t *last  = first + PAGE_SIZE - size;
+    for (uint8_t *obj = first; obj < last; obj += size)
+        *(void **)obj = obj + size;
+    *(void **)last = NULL;
+
+    struct slab *sl = &km.slab[s];
+    sl->free   = first;
+    sl->inuse  = 0;
+    sl->sclass = (uint8_t)sclass;
+    partial_insert(sclass, s);
+    return s;
+}
+
+/// Return an empty slab's page to the unused list.
+static void
+slab_release(uint16_t s)
+{
+    struct slab *sl = &km.slab[s];
+    partial_remove(sl->sclass, s);
+    sl->sclass = SLAB_UNUSED;
+    sl->free   = NULL;
+    sl->next   = km.unused;
+    km.unused  = s;
+}
+
+/// Return the calling CPU's arena, creating its heap the first time the CPU
+/// uses it. Return NULL if the arena's memory couldn't be allocated.
+static struct arena *
+arena_local()
+{
+    struct arena *a = &arena[cpu_index()];
+    if (a->heap != NULL)
+        return a;
+
+    // The frame allocator prefers memory on the CPU's NUMA node.
+    a->base = (uint8_t *)page_frame_alloc(ARENA_ORDER);
+    if (a->base == NULL)
+        return NULL;
+    a->heap = heap_create(NULL, a->base, ARENA_PAGES);
+    return a;
+}
+
+/// Return the arena holding an allocation, or NULL if it's in none.
+static struct arena *
+arena_find(const void *ptr)
+{
+    for (int c = 0; c < MAX_CPUS; c++) {
+        struct arena *a = &arena[c];
+        if (a->heap != NULL &&
+            (uint64_t)((const uint8_t *)ptr - a->base) <
+            (uint64_t)ARENA_PAGES * PAGE_SIZE)
+            return a;
+    }
+    return NULL;
+}
+
+/// Free the allocations other CPUs have pushed onto an arena's remote-free
+/// list. Must be called by the arena's owner.
+static void
+arena_drain(struct arena *a)
+{
+    void *ptr = atomic_exchange_explicit(&a->remote, NULL,
+                                         memory_order_acquire);
+    if (ptr == NULL)
+        return;
+
+    while (ptr != NULL) {
+        void *next = *(void **)ptr;
+        heap_free(a->heap, ptr);
+        a->frees++;
+        ptr = next;
+    }
+    a->drains++;
+}
+
+/// Push an allocation onto the remote-free list of the arena holding it.
+static void
+arena_free_remote(struct arena *a, void *ptr)
+{
+    void *head = atomic_load_explicit(&a->remote, memory_order_relaxed);
+    do {
+        *(void **)ptr = head;
+    } while (!atomic_compare_exchange_weak_explicit(&a->remote, &head, ptr,
+                                                    memory_order_release,
+                                                    memory_order_relaxed));
+    atomic_fetch_add_explicit(&a->remote_frees, 1, memory_order_relaxed);
+}
+
+void
+kmalloc_init()
+{
+    // The slab region is identity-mapped by the kernel page table, so its
+    // addresses are valid in every page table. So are the arena regions.
+    km.slabbase = (uint8_t *)page_frame_alloc(SLAB_ORDER);
+    if (km.slabbase == NULL)
+        fatal();
+
+    km.unused    = SLAB_NONE;
+    km.untouched = 0;
+    for (int c = 0; c < KMALLOC_CLASSES; c++)
+        km.partial[c] = SLAB_NONE;
+    for (int s = 0; s < SLAB_PAGES; s++)
+        km.slab[s].sclass = SLAB_UNUSED;
+
+    // Set up the bootstrap processor's arena now, so that early large
+    // allocations can't fail for lack of one.
+    const struct arena *a = arena_local();
+    if (a == NULL)
+        fatal();
+
+    logf(LOG_INFO, "[kmalloc] Slabs at %#lx (%luKiB), %luKiB arenas.",
+         (uint64_t)km.slabbase, ((uint64_t)SLAB_PAGES * PAGE_SIZE) >> 10,
+         ((uint64_t)ARENA_PAGES * PAGE_SIZE) >> 10);
+}
+
+void *
+kmalloc(uint64_t size)
+{
+    if (size <= KMALLOC_MAX_SIZE) {
+        int      sclass = size_class(size);
+        uint16_t s      = km.partial[sclass];
+        if (s == SLAB_NONE)
+            s = slab_create(sclass);
+
+        // Pop the first free object. A slab that becomes full leaves the
+        // partial list until one of its objects is freed.
+        if (s != SLAB_NONE) {
+            struct slab *sl  = &km.slab[s];
+            void        *obj = sl->free;
+            sl->free = *(void **)obj;
+            sl->inuse++;
+            if (sl->free == NULL)
+                partial_remove(sclass, s);
+            km.allocs++;
+            return obj;
+        }
+
+        // If the slab region is exhausted, fall through to the CPU's arena.
+    }
+
+    struct arena *a = arena_local();
+    if (a == NULL)
+        return NULL;
+    if (atomic_load_explicit(&a->remote, memory_order_relaxed) != NULL)
+        arena_drain(a);
+
+    void *ptr = heap_alloc(a->heap, size);
+    if (ptr != NULL) {
+        km.allocs++;
+        a->allocs++;
+    }
+    return ptr;
+}
+
+void
+kfree(void *ptr)
+{
+    if (ptr == NULL)
+        return;
+
+    uint64_t off = (uint64_t)((uint8_t *)ptr - km.slabbase);
+    if (off >= (uint64_t)SLAB_PAGES * PAGE_SIZE) {
+        struct arena *a = arena_find(ptr);
+        if (a == NULL)
+            fatal();
+        if (a == &arena[cpu_index()]) {
+            heap_free(a->heap, ptr);
+            a->frees++;
+        }
+        else {
+            arena_free_remote(a, ptr);
+        }
+        km.frees++;
+        return;
+    }
+
+    uint16_t     s  = (uint16_t)(off / PAGE_SIZE);
+    struct slab *sl = &km.slab[s];
+    if (sl->sclass == SLAB_UNUSED ||
+        (off & (class_size(sl->sclass) - 1)) != 0)
+        fatal();
+
+    // A full slab rejoins the partial list once it has a free object.
+    if (sl->free == NULL)
+        partial_insert(sl->sclass, s);
+    *(void **)ptr = sl->free;
+    sl->free      = ptr;
+    sl->inuse--;
+    km.frees++;
+
+    // Release an empty slab unless it's the only one left in its class, so
+    // that alternating allocs and frees don't rebuild the same slab.
+    if (sl->inuse == 0 &&
+        (km.partial[sl->sclass] != s || sl->next != SLAB_NONE))
+        slab_release(s);
+}
+
+void
+kmalloc_stats(kmallocstats_t *stats)
+{
+    memzero(stats, sizeof(kmallocstats_t));
+    stats->slab_pages  = SLAB_PAGES;
+    stats->allocs      = km.allocs;
+    stats->frees       = km.frees;
+
+    for (int s = 0; s < km.untouched; s++) {
+        const struct slab *sl = &km.slab[s];
+        if (sl->sclass == SLAB_UNUSED)
+            continue;
+        stats->slab_pages_used++;
+        stats->slabs[sl->sclass]++;
+        stats->objects[sl->sclass] += sl->inuse;
+    }
+
+    for (int c = 0; c < MAX_CPUS; c++) {
+        const struct arena  *a  = &arena[c];
+        kmallocarenastats_t *as = &stats->arena[c];
+        if (a->heap == NULL)
+            continue;
+
+        heapstats_t hs;
+        heap_stats(a->heap, &hs);
+        as->pages        = hs.pages;
+        as->used_bytes   = hs.used_bytes;
+        as->allocs       = a->allocs;
+        as->frees        = a->frees;
+        as->remote_frees = atomic_load_explicit(&a->remote_frees,
+                                                memory_order_relaxed);
+        as->drains       = a->drains;
+        stats->heap_allocs += a->allocs;
+    }
+}
@@ -15,18 +15,73 @@
 #include <kernel/mem/pmap.h>
 #include "kmem.h"
 
-/// Return flags for large-page leaf entries in level 3 (PDPT) and level 2
-/// (PDT) tables.
+// Page attribute table MSR
+#define MSR_IA32_PAT       0x277
+
+// CPUID feature flags
+#define CPUID1_EDX_PAT     (1 << 16)
+
+// Memory types held in the entries of the page attribute table
+#define PAT_UC             0x00     // Uncacheable
+#define PAT_WC             0x01     // Write-combining
+#define PAT_WT             0x04     // Write-through
+#define PAT_WB             0x06     // Write-back
+#define PAT_UC_MINUS       0x07     // Uncacheable, overridable by MTRRs
+
+// The page attribute table programmed by the kernel. Entries 0-3, selected
+// by the PWT and PCD flags alone, keep their power-on types, so existing
+// mappings are unaffected. Entry 4, selected by the PAT flag, becomes
+// write-combining.
+#define PAT_VALUE          ((uint64_t)PAT_WB | (uint64_t)PAT_WT << 8 | \
+                            (uint64_t)PAT_UC_MINUS << 16 | \
+                            (uint64_t)PAT_UC << 24 | (uint64_t)PAT_WC << 32 | \
+                            (uint64_t)PAT_WT << 40 | \
+                            (uint64_t)PAT_UC_MINUS << 48 | \
+                            (uint64_t)PAT_UC << 56)
+
+static bool pat_enabled;
+
+/// Program the page attribute table, if the CPU has one.
+static void
+pat_init()
+{
+    registers4_t regs;
+    cpuid(1, &regs);
+    if ((regs.rdx & CPUID1_EDX_PAT) == 0)
+        return;
+
+    wrmsr(MSR_IA32_PAT, PAT_VALUE);
+    pat_enabled = true;
+}
+
+/// Return the cache control flags selecting the page attribute table entry
+/// for a memory type. Leaf entries of different levels hold the PAT flag in
+/// different bits. Without a PAT, write-combining memory is uncached.
 static uint64_t
-get_pdflags(uint32_t memtype)
+get_cacheflags(uint32_t memtype, uint64_t patflag)
 {
     switch (memtype)
     {
         case PMEMTYPE_ACPI_NVS:
         case PMEMTYPE_UNCACHED:
-            return PF_PRESENT | PF_GLOBAL | PF_SYSTEM |
-                   PF_RW | PF_PS | PF_PWT | PF_PCD;
+            return PF_PWT | PF_PCD;
+
+        case PMEMTYPE_WRITETHROUGH:
+            return PF_PWT;
+
+        case PMEMTYPE_WRITECOMBINE:
+            return pat_enabled ? patflag : PF_PWT | PF_PCD;
+
+        default:
+            return 0;
+    }
+}
 
+uint64_t
+kmem_pdflags(uint32_t memtype)
+{
+    switch (memtype)
+    {
         case PMEMTYPE_BAD:
         case PMEMTYPE_UNMAPPED:
             return 0;
@@ -34,7 +89,12 @@ get_pdflags(uint32_t memtype)
         case PMEMTYPE_USABLE:
         case PMEMTYPE_RESERVED:
         case PMEMTYPE_ACPI:
-            return PF_PRESENT | PF_GLOBAL | PF_SYSTEM | PF_RW | PF_PS;
+        case PMEMTYPE_ACPI_NVS:
+        case PMEMTYPE_UNCACHED:
+        case PMEMTYPE_WRITETHROUGH:
+        case PMEMTYPE_WRITECOMBINE:
+            return PF_PRESENT | PF_GLOBAL | PF_SYSTEM | PF_RW | PF_PS |
+                   get_cacheflags(memtype, PF_PAT_LARGE);
 
         default:
             fatal();
@@ -42,17 +102,11 @@ get_pdflags(uint32_t memtype)
     }
 }
 
-/// Return flags for entries in level 1 (PT) tables.
-static uint64_t
-get_ptflags(uint32_t memtype)
+uint64_t
+kmem_ptflags(uint32_t memtype)
 {
     switch (memtype)
     {
-        case PMEMTYPE_ACPI_NVS:
-        case PMEMTYPE_UNCACHED:
-            return PF_PRESENT | PF_GLOBAL | PF_SYSTEM |
-                   PF_RW | PF_PWT | PF_PCD;
-
         case PMEMTYPE_BAD:
         case PMEMTYPE_UNMAPPED:
             return 0;
@@ -60,7 +114,12 @@ get_ptflags(uint32_t memtype)
         case PMEMTYPE_USABLE:
         case PMEMTYPE_RESERVED:
         case PMEMTYPE_ACPI:
-            return PF_PRESENT | PF_GLOBAL | PF_SYSTEM | PF_RW;
+        case PMEMTYPE_ACPI_NVS:
+        case PMEMTYPE_UNCACHED:
+        case PMEMTYPE_WRITETHROUGH:
+        case PMEMTYPE_WRITECOMBINE:
+            return PF_PRESENT | PF_GLOBAL | PF_SYSTEM | PF_RW |
+                   get_cacheflags(memtype, PF_PAT);
 
         default:
             fatal();
@@ -93,7 +152,7 @@ create_huge_page(pagetable_t *pt, uint64_t addr, uint32_t memtype)
         pml4t->entry[pml4te] = alloc_page(pt);
 
     page_t *pdpt = PGPTR(pml4t->entry[pml4te]);
-    pdpt->entry[pdpte] = addr | get_pdflags(memtype);
+    pdpt->entry[pdpte] = addr | kmem_pdflags(memtype);
 }
 
 /// Create a 2MiB page entry in the kernel page table.
@@ -113,7 +172,7 @@ create_large_page(pagetable_t *pt, uint64_t addr, uint32_t memtype)
         pdpt->entry[pdpte] = alloc_page(pt);
 
     page_t *pdt = PGPTR(pdpt->entry[pdpte]);
-    pdt->entry[pde] = addr | get_pdflags(memtype);
+    pdt->entry[pde] = addr | kmem_pdflags(memtype);
 }
 
 /// Create a 4KiB page entry in the kernel page table.
@@ -138,7 +197,7 @@ create_small_page(pagetable_t *pt, uint64_t addr, uint32_t memtype)
         pdt->entry[pde] = alloc_page(pt);
 
     page_t *ptt = PGPTR(pdt->entry[pde]);
-    ptt->entry[pte] = addr | get_ptflags(memtype);
+    ptt->entry[pte] = addr | kmem_ptflags(memtype);
 }
 
 /// Map a region of memory into the kernel page table, using the largest
@@ -188,6 +247,10 @@ map_region(pagetable_t *pt, const pmap_t *map, const pmapregion_t *region)
 void
 kmem_init(pagetable_t *pt)
 {
+    // Program the page attribute table before any mapping selects its
+    // write-combining entry.
+    pat_init();
+
     // Zero all kernel page table memory.
     memzero((void *)KMEM_KERNEL_PAGETABLE, KMEM_KERNEL_PAGETABLE_SIZE);
 
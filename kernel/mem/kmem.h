@@ -53,3 +53,23 @@
 //----------------------------------------------------------------------------
 void
 kmem_init(pagetable_t *pt);
+
+//----------------------------------------------------------------------------
+//  @function       kmem_pdflags
+/// @brief          Return the kernel page table flags for a large or huge
+///                 page leaf entry mapping memory of a given type.
+/// @param[in]      memtype The pmemtype of the mapped memory.
+/// @returns        The entry flags, or 0 if the memory must not be mapped.
+//----------------------------------------------------------------------------
+uint64_t
+kmem_pdflags(uint32_t memtype);
+
+//----------------------------------------------------------------------------
+//  @function       kmem_ptflags
+/// @brief          Return the kernel page table flags for a small page leaf
+///                 entry mapping memory of a given type.
+/// @param[in]      memtype The pmemtype of the mapped memory.
+/// @returns        The entry flags, or 0 if the memory must not be mapped.
+//----------------------------------------------------------------------------
+uint64_t
+kmem_ptflags(uint32_t memtype);
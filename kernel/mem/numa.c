@@ -0,0 +1,239 @@
+//============================================================================
+/// @file       numa.c
+/// @brief      Non-uniform memory access (NUMA) topology.
+//
+//  Copyright 2016 Brett Vickers.
+//  Use of this source code is governed by a BSD-style license
+//  that can be found in the MonkOS LICENSE file.
+//============================================================================
+
+#include <core.h>
+#include <libc/string.h>
+#include <kernel/debug/log.h>
+#include <kernel/mem/acpi.h>
+#include <kernel/mem/numa.h>
+#include <kernel/x86/cpu.h>
+
+// Maximum number of SRAT memory ranges tracked
+#define MAX_NUMA_RANGES  32
+
+// SRAT affinity entry flags
+#define SRAT_ENABLED     (1 << 0)
+
+/// A contiguous range of physical memory belonging to a single node.
+struct numarange
+{
+    uint64_t addr;          ///< First byte of the range
+    uint64_t term;          ///< Just beyond the last byte of the range
+    int      node;          ///< Node index
+};
+
+struct numa
+{
+    int              count;                                    // Nodes
+    uint32_t         domain[MAX_NUMA_NODES];                   // Node's domain
+    uint8_t          distance[MAX_NUMA_NODES][MAX_NUMA_NODES];
+    uint8_t          fallback[MAX_NUMA_NODES][MAX_NUMA_NODES];
+    uint8_t          cpunode[MAX_CPUS];                        // CPU's node
+    int              ranges;                                   // Range count
+    struct numarange range[MAX_NUMA_RANGES];                   // By address
+};
+
+static struct numa numa;
+
+/// Return the node index for an ACPI proximity domain, assigning a new index
+/// the first time the domain is seen.
+static int
+domain_node(uint32_t domain)
+{
+    for (int n = 0; n < numa.count; n++) {
+        if (numa.domain[n] == domain)
+            return n;
+    }
+
+    if (numa.count == MAX_NUMA_NODES) {
+        logf(LOG_WARNING, "[numa] Too many nodes, folding domain %u into 0.",
+             domain);
+        return 0;
+    }
+
+    numa.domain[numa.count] = domain;
+    return numa.count++;
+}
+
+/// Add a memory range to the address-sorted range table.
+static void
+add_range(uint64_t addr, uint64_t size, int node)
+{
+    if (numa.ranges == MAX_NUMA_RANGES) {
+        logf(LOG_WARNING, "[numa] Too many memory ranges, ignoring %#lx.",
+             addr);
+        return;
+    }
+
+    int i = numa.ranges++;
+    for (; i > 0 && numa.range[i - 1].addr > addr; i--)
+        numa.range[i] = numa.range[i - 1];
+
+    numa.range[i].addr = addr;
+    numa.range[i].term = addr + size;
+    numa.range[i].node = node;
+}
+
+static void
+read_distances()
+{
+    const struct acpi_slit *slit = acpi_slit();
+
+    for (int from = 0; from < numa.count; from++) {
+        for (int to = 0; to < numa.count; to++) {
+            uint32_t df = numa.domain[from];
+            uint32_t dt = numa.domain[to];
+            if (slit != NULL && df < slit->localities &&
+                dt < slit->localities) {
+                numa.distance[from][to] =
+                    slit->distance[df * slit->localities + dt];
+            }
+            else {
+                numa.distance[from][to] = (from == to)
+                                          ? NUMA_DISTANCE_LOCAL
+                                          : NUMA_DISTANCE_REMOTE;
+            }
+        }
+    }
+}
+
+static void
+build_fallbacks()
+{
+    for (int n = 0; n < numa.count; n++) {
+        uint8_t *fb = numa.fallback[n];
+
+        // Start with the node itself, then insertion-sort the remaining
+        // nodes by distance.
+        fb[0] = (uint8_t)n;
+        int count = 1;
+        for (int o = 0; o < numa.count; o++) {
+            if (o == n)
+                continue;
+            int i = count++;
+            for (; i > 1 && numa.distance[n][fb[i - 1]] > numa.distance[n][o];
+                 i--)
+                fb[i] = fb[i - 1];
+            fb[i] = (uint8_t)o;
+        }
+    }
+}
+
+static void
+read_bsp_node()
+{
+    // Only the bootstrap processor is running, so its local APIC id is the
+    // only one that can be mapped to a CPU index.
+    registers4_t regs;
+    cpuid(1, &regs);
+    uint32_t apicid = (uint32_t)(regs.rbx >> 24) & 0xff;
+
+    const struct acpi_srat_local_apic *la = NULL;
+    while ((la = acpi_next_srat_local_apic(la)) != NULL) {
+        if ((la->flags & SRAT_ENABLED) && la->apicid == apicid) {
+            uint32_t domain = la->domain_lo |
+                              ((uint32_t)la->domain_hi[0] << 8) |
+                              ((uint32_t)la->domain_hi[1] << 16) |
+                              ((uint32_t)la->domain_hi[2] << 24);
+            numa.cpunode[0] = (uint8_t)domain_node(domain);
+            return;
+        }
+    }
+
+    const struct acpi_srat_local_x2apic *lx = NULL;
+    while ((lx = acpi_next_srat_local_x2apic(lx)) != NULL) {
+        if ((lx->flags & SRAT_ENABLED) && lx->x2apicid == apicid) {
+            numa.cpunode[0] = (uint8_t)domain_node(lx->domain);
+            return;
+        }
+    }
+}
+
+void
+numa_init()
+{
+    memzero(&numa, sizeof(numa));
+
+    // Record the node of each enabled SRAT memory range.
+    const struct acpi_srat_memory *mem = NULL;
+    while ((mem = acpi_next_srat_memory(mem)) != NULL) {
+        if ((mem->flags & SRAT_ENABLED) == 0 || mem->length == 0)
+            continue;
+        add_range(mem->base, mem->length, domain_node(mem->domain));
+    }
+
+    // Without an SRAT, treat the whole machine as a single node.
+    if (numa.count == 0) {
+        numa.count = 1;
+        numa.distance[0][0] = NUMA_DISTANCE_LOCAL;
+        numa.fallback[0][0] = 0;
+        return;
+    }
+
+    read_bsp_node();
+    read_distances();
+    build_fallbacks();
+
+    for (int n = 0; n < numa.count; n++) {
+        uint64_t size = 0;
+        for (int r = 0; r < numa.ranges; r++) {
+            if (numa.range[r].node == n)
+                size += numa.range[r].term - numa.range[r].addr;
+        }
+        logf(LOG_INFO, "[numa] Node %d: domain=%u mem=%luMiB",
+             n, numa.domain[n], size >> 20);
+    }
+}
+
+int
+numa_nodes()
+{
+    return numa.count;
+}
+
+int
+numa_paddr_node(uint64_t paddr, uint64_t *term)
+{
+    uint64_t next = (uint64_t)-1;
+    for (int r = 0; r < numa.ranges; r++) {
+        const struct numarange *range = &numa.range[r];
+        if (paddr < range->addr) {
+            next = range->addr;
+            break;
+        }
+        if (paddr < range->term) {
+            if (term != NULL)
+                *term = range->term;
+            return range->node;
+        }
+    }
+
+    // Memory not described by the SRAT belongs to node 0.
+    if (term != NULL)
+        *term = next;
+    return 0;
+}
+
+int
+numa_cpu_node(int cpu)
+{
+    return numa.cpunode[cpu];
+}
+
+int
+numa_distance(int from, int to)
+{
+    return numa.distance[from][to];
+}
+
+const uint8_t *
+numa_fallback(int node)
+{
+    return numa.fallback[node];
+}
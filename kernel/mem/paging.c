@@ -11,27 +11,98 @@
 #include <libc/stdlib.h>
 #include <libc/string.h>
 #include <kernel/x86/cpu.h>
+#include <kernel/debug/log.h>
+#include <kernel/device/timer.h>
+#include <kernel/interrupt/exception.h>
 #include <kernel/interrupt/interrupt.h>
+#include <kernel/mem/numa.h>
 #include <kernel/mem/pmap.h>
 #include <kernel/mem/paging.h>
+#include <kernel/mem/zswap.h>
 #include "kmem.h"
 
 // add_pte addflags
 #define CONTAINS_TABLE     (1 << 0)
+#define LARGE_PAGE         (1 << 1) // Map a 2MiB page in the PD table
+#define HUGE_PAGE          (1 << 2) // Map a 1GiB page in the PDPT table
 
 // Page shift constants
 #define PAGE_SHIFT         12       // 1<<12 = 4KiB
 #define PAGE_SHIFT_LARGE   21       // 1<<21 = 2MiB
 
+// Per-CPU page frame cache constants
+#define PFCACHE_SIZE       64       // Frames held by each CPU's cache
+#define PFCACHE_BATCH      32       // Frames moved per refill or drain
+
+// Pre-zeroed page pool constants
+#define ZPOOL_SIZE         256      // Maximum frames held in the pool
+#define ZPOOL_BATCH        8        // Frames zeroed per idle call
+
+// TLB invalidation constants
+#define TLB_FLUSH_THRESHOLD 32      // Most pages invalidated one at a time
+
+// Process-context identifier constants
+#define PCID_COUNT         64       // PCIDs in the pool (0 is the kernel's)
+#define CPUID1_ECX_PCID    (1 << 17)
+#define CPUID7_EBX_INVPCID (1 << 10)
+
+// Compressed swap constants
+#define SWAP_WATERMARK     512      // Free frames below which pages swap out
+#define SWAP_BATCH         64       // Pages swapped out per reclaim
+#define SWAP_RETRY         256      // Allocs before a stalled reclaim retries
+#define SWAP_FLAGS         (PF_RW | PF_USER | PF_PWT | PF_PCD)
+
+// Reclaim scanner constants
+#define LRU_BATCH          512      // Page table entries aged per idle call
+#define LRU_PERIOD         (1ull << 31) // Minimum cycles between sweeps
+
+// Kernel map constants
+#define KMAP_CPU_FLAGS     (PF_ACCESS | PF_DIRTY) // Flags set by the CPU
+
+// Same-page merging constants
+#define MERGE_BUCKETS      4096     // Entries in the page content hash table
+
+// Page fault error code bits
+#define PFERR_PRESENT      (1 << 0) // Fault caused by a protection violation
+#define PFERR_WRITE        (1 << 1) // Fault caused by a write access
+#define PFERR_USER         (1 << 2) // Fault occurred in user mode
+
 // Page frame number constants
 #define PFN_INVALID        ((uint32_t)-1)
 
+// Page frame database section constants
+#define PFSECTION_SHIFT    15       // 1<<15 frames = 128MiB per section
+#define PFSECTION_FRAMES   (1u << PFSECTION_SHIFT)
+#define PFSECTION_MASK     (PFSECTION_FRAMES - 1)
+#define PFSECTION_ABSENT   ((uint32_t)-1)
+#define PFSECTION_DEFERRED (1u << 31) // Section's records aren't initialized
+
 // Helper macros
-#define PADDR_TO_PF(a)     ((pf_t *)(pfdb.pf + ((a) >> PAGE_SHIFT)))
-#define PF_TO_PADDR(pf)    ((uint64_t)((pf) - pfdb.pf) << PAGE_SHIFT)
-#define PFN_TO_PF(pfn)     ((pf_t *)((pfn) + pfdb.pf))
-#define PF_TO_PFN(pf)      ((uint32_t)((pf) - pfdb.pf))
+#define PFN_TO_PF(pfn)     (pfdb.pf + \
+                            ((uint64_t)pfdb.section[(pfn) >> PFSECTION_SHIFT] \
+                             << PFSECTION_SHIFT) + ((pfn) & PFSECTION_MASK))
+#define PF_TO_PFN(p)       ((uint32_t)( \
+                            (pfdb.secnum[((p) - pfdb.pf) >> PFSECTION_SHIFT] \
+                             << PFSECTION_SHIFT) | \
+                            (((p) - pfdb.pf) & PFSECTION_MASK)))
+#define PFN_VALID(pfn)     ((pfn) < pfdb.count && \
+                            (pfdb.section[(pfn) >> PFSECTION_SHIFT] & \
+                             PFSECTION_DEFERRED) == 0)
+#define PFN_DEFERRED(pfn)  ((pfn) < pfdb.count && \
+                            pfdb.section[(pfn) >> PFSECTION_SHIFT] != \
+                            PFSECTION_ABSENT && \
+                            (pfdb.section[(pfn) >> PFSECTION_SHIFT] & \
+                             PFSECTION_DEFERRED))
+#define PADDR_TO_PF(a)     PFN_TO_PF((a) >> PAGE_SHIFT)
+#define PADDR_VALID(a)     PFN_VALID((a) >> PAGE_SHIFT)
+#define PF_TO_PADDR(p)     PFN_TO_PADDR(PF_TO_PFN(p))
+#define PFN_TO_PADDR(pfn)  ((uint64_t)(pfn) << PAGE_SHIFT)
 #define PTE_TO_PADDR(pte)  ((pte) & ~PGMASK_OFFSET)
+#define PGMASK_PADDR       0x000ffffffffff000ull // Frame address in a PTE
+#define PGMASK_PADDR_LARGE 0x000fffffffffe000ull // Same, in a PS leaf entry
+#define PTE_TO_SLOT(pte)   ((uint32_t)((pte) >> PAGE_SHIFT))
+#define CANONICAL(a)       (((a) & (1ull << 47)) ? (a) | 0xffff000000000000 \
+                                                 : (a))
 
 // Page frame types
 enum
@@ -41,38 +112,245 @@ enum
     PFTYPE_ALLOCATED = 2,
 };
 
+// Page frame flags
+#define PFFLAG_HEAD        (1 << 0) // Frame is the first in a buddy block
+#define PFFLAG_ACTIVE      (1 << 1) // Frame is on the active list
+#define PFFLAG_INACTIVE    (1 << 2) // Frame is on the inactive list
+#define PFFLAG_LRU         (PFFLAG_ACTIVE | PFFLAG_INACTIVE)
+
+// LRU lists
+enum
+{
+    LRU_ACTIVE   = 0,
+    LRU_INACTIVE = 1,
+};
+
 /// The pf structure represents a record in the page frame database.
 typedef struct pf
 {
-    uint32_t prev;          ///< Index of prev pfn on available list
-    uint32_t next;          ///< Index of next pfn on available list
+    uint32_t prev;          ///< Index of prev pfn on available or LRU list
+    uint32_t next;          ///< Index of next pfn on available or LRU list
     uint16_t refcount;      ///< Number of references to this page
     uint16_t sharecount;    ///< Number of processes sharing page
-    uint16_t flags;
+    uint8_t  flags;         ///< PFFLAG bits
     uint8_t  type;          ///< PFTYPE of page frame
-    uint8_t  reserved0;
-    uint64_t reserved1;
-    uint64_t reserved2;
+    uint8_t  order;         ///< Buddy block order (valid for head frames)
+    uint8_t  node;          ///< NUMA node containing the frame
 } pf_t;
 
-STATIC_ASSERT(sizeof(pf_t) == 32, "Unexpected page frame size");
+STATIC_ASSERT(sizeof(pf_t) == 16, "Unexpected page frame size");
+
+/// The pfnode describes the available frames belonging to one NUMA node.
+struct pfnode
+{
+    uint32_t avail;               ///< Available number of frames on the node
+    uint32_t deferred;            ///< Frames of the node in deferred sections
+    uint32_t head[PFORDER_COUNT]; ///< Available block list heads, by order
+    uint32_t free[PFORDER_COUNT]; ///< Available block counts, by order
+};
 
-/// The pfdb describes the state of the page frame database.
+/// The pfdb describes the state of the page frame database. Physical memory
+/// is divided into sections, and page frame records exist only for sections
+/// containing usable memory. The record arrays of these present sections
+/// are packed in address order, so the records of a buddy block, which
+/// never spans an absent section, are always contiguous.
+///
+/// To keep boot time independent of memory size, the records of a present
+/// section aren't initialized until the allocator runs out of initialized
+/// free blocks, or the CPU is idle. Until then the section is deferred: its
+/// usable frames are counted as available, but its records are never read.
 struct pfdb
 {
-    pf_t    *pf;          ///< Pointer to array of page frames
-    uint32_t count;       ///< Total number of frames in the pfdb
-    uint32_t avail;       ///< Available number of frames in the pfdb
-    uint32_t head;        ///< Index of available frame list head
-    uint32_t tail;        ///< Index of available frame list tail
+    pf_t         *pf;                   ///< Packed arrays of section frames
+    uint32_t     *section;              ///< Packed index of each section
+    uint32_t     *secnum;               ///< Section of each packed array
+    uint32_t      count;                ///< Frames in the physical range
+    uint32_t      sections;             ///< Sections in the physical range
+    uint32_t      present;              ///< Sections with frame records
+    uint64_t      size;                 ///< Bytes of memory used by the pfdb
+    uint32_t      avail;                ///< Available number of frames
+    uint32_t      deferred;             ///< Frames in deferred sections
+    uint32_t      next_deferred;        ///< First section not initialized
+    struct pfnode node[MAX_NUMA_NODES]; ///< Per-node available frames
+};
+
+/// A pfcache is a per-CPU magazine of single page frames sitting in front of
+/// the buddy allocator, so most frame allocations and frees touch only
+/// CPU-local state.
+struct pfcache
+{
+    uint32_t count;               ///< Frames currently in the cache
+    uint32_t pfn[PFCACHE_SIZE];   ///< Cached frame numbers (top is hottest)
+    uint64_t hits;                ///< Allocs/frees served by the cache alone
+    uint64_t refills;             ///< Batches pulled from the buddy lists
+    uint64_t drains;              ///< Batches returned to the buddy lists
+} CACHEALIGN;
+
+/// The zpool holds allocated frames whose contents were zeroed while the CPU
+/// was idle, so pgalloc can usually skip zeroing on the allocation path.
+struct zpool
+{
+    uint32_t count;               ///< Frames currently in the pool
+    uint32_t pfn[ZPOOL_SIZE];     ///< Pooled frame numbers
+    uint64_t hits;                ///< Page allocations served by the pool
+    uint64_t misses;              ///< Page allocations zeroed synchronously
+};
+
+/// A tlbbatch accumulates the virtual addresses of the page table entries
+/// changed in a page table, so their TLB entries can be invalidated all at
+/// once. Batches holding more than TLB_FLUSH_THRESHOLD pages are committed
+/// by flushing the entire TLB.
+struct tlbbatch
+{
+    pagetable_t *pt;                         ///< Page table that changed
+    uint32_t     count;                      ///< Pages in the batch
+    uint64_t     vaddr[TLB_FLUSH_THRESHOLD]; ///< Addresses of the pages
+};
+
+/// The pcidpool assigns process-context identifiers to page tables, so the
+/// TLB entries of a page table survive while other page tables are active.
+/// When the pool runs out, PCIDs are recycled round-robin.
+struct pcidpool
+{
+    bool         enabled;                ///< PCIDs are enabled in CR4
+    bool         invpcid;                ///< CPU supports INVPCID
+    uint32_t     next;                   ///< Next PCID to recycle
+    pagetable_t *owner[PCID_COUNT];      ///< Page table assigned each PCID
+    bool         stale[PCID_COUNT];      ///< PCID's TLB entries are stale
+};
+
+/// The lru tracks the frames mapped by page tables on two lists linked
+/// through their page frame records. Frames referenced since they were last
+/// aged are on the active list, and the rest are on the inactive list. The
+/// reclaim scanner sweeps every registered page table in clock order, aging
+/// each mapped frame and estimating each table's working set.
+struct lru
+{
+    uint32_t     head[2];         ///< List heads, by LRU list
+    uint32_t     count[2];        ///< Frames on each list
+    pagetable_t *pt;              ///< Page table being swept (NULL if none)
+    uint64_t     hand;            ///< Just beyond the last address swept
+    uint64_t     start;           ///< Timestamp of the last sweep's start
+    uint32_t     rss;             ///< Resident pages seen by this sweep
+    uint32_t     wss;             ///< Referenced pages seen by this sweep
+};
+
+/// The merge table indexes write-protected pages by a hash of their
+/// contents, so the reclaim scanner can find pages identical to the ones it
+/// scans. Each bucket holds the last page hashed into it.
+struct merge
+{
+    bool     enabled;                ///< Same-page merging is enabled
+    uint64_t hash[MERGE_BUCKETS];    ///< Content hash of each bucket's page
+    uint32_t pfn[MERGE_BUCKETS];     ///< Frame holding each bucket's page
+};
+
+/// The memacct counts frame allocations and frees, and measures their rates
+/// over intervals of at least a second.
+struct memacct
+{
+    uint64_t allocs;              ///< Frames allocated
+    uint64_t frees;               ///< Frames freed
+    uint64_t table_pages;         ///< Page table pages allocated by add_pte
+    uint64_t ticks;               ///< Timer ticks at the interval's start
+    uint64_t ticks_allocs;        ///< Frames allocated at the interval's start
+    uint64_t ticks_frees;         ///< Frames freed at the interval's start
+    uint64_t alloc_rate;          ///< Frames allocated per second
+    uint64_t free_rate;           ///< Frames freed per second
 };
 
-static struct pfdb  pfdb;      // Global page frame database
+static struct pfdb    pfdb;              // Global page frame database
+static struct pfcache pfcache[MAX_CPUS]; // Per-CPU page frame caches
+static struct zpool   zpool;             // Pre-zeroed page pool
+static pgstats_t      pgstats;           // Paging statistics
+static struct pcidpool pcids;            // Process-context identifiers
+static struct lru     lru;               // Active and inactive frames
+static struct merge   merge;             // Same-page merging table
+static struct memacct memacct;           // Memory accounting counters
+static uint64_t       zero_page;         // Shared read-only page of zeros
+static bool           swapping;          // Swap scan in progress
+static bool           swap_stalled;      // Last reclaim made no progress
+static uint64_t       swap_stall_allocs; // memacct.allocs at the stall
+static uint64_t       swap_stall_frees;  // memacct.frees at the stall
+static pagetable_t   *pagetables;        // Registry of page tables
 static pagetable_t  kpt;       // Kernel page table (all physical memory)
 static pagetable_t *active_pt; // Currently active page table
 
 // TODO: Modify to support multi-core
 
+/// Push a buddy block onto the head of the available list for its order.
+static void
+freelist_push(pf_t *pf, int order)
+{
+    struct pfnode *node = &pfdb.node[pf->node];
+    uint32_t       pfn  = PF_TO_PFN(pf);
+    pf->prev = PFN_INVALID;
+    pf->next = node->head[order];
+    if (pf->next != PFN_INVALID)
+        PFN_TO_PF(pf->next)->prev = pfn;
+    node->head[order] = pfn;
+    node->free[order]++;
+}
+
+/// Remove a buddy block from the available list for its order.
+static void
+freelist_remove(pf_t *pf, int order)
+{
+    struct pfnode *node = &pfdb.node[pf->node];
+    if (pf->prev == PFN_INVALID)
+        node->head[order] = pf->next;
+    else
+        PFN_TO_PF(pf->prev)->next = pf->next;
+    if (pf->next != PFN_INVALID)
+        PFN_TO_PF(pf->next)->prev = pf->prev;
+    node->free[order]--;
+}
+
+/// Push an allocated frame onto the head of an LRU list.
+static void
+lru_push(pf_t *pf, int list)
+{
+    uint32_t pfn = PF_TO_PFN(pf);
+    pf->prev = PFN_INVALID;
+    pf->next = lru.head[list];
+    if (pf->next != PFN_INVALID)
+        PFN_TO_PF(pf->next)->prev = pfn;
+    lru.head[list] = pfn;
+    lru.count[list]++;
+    pf->flags |= (list == LRU_ACTIVE) ? PFFLAG_ACTIVE : PFFLAG_INACTIVE;
+}
+
+/// Remove a frame from the LRU list holding it, if any.
+static void
+lru_remove(pf_t *pf)
+{
+    if ((pf->flags & PFFLAG_LRU) == 0)
+        return;
+
+    int list = (pf->flags & PFFLAG_ACTIVE) ? LRU_ACTIVE : LRU_INACTIVE;
+    if (pf->prev == PFN_INVALID)
+        lru.head[list] = pf->next;
+    else
+        PFN_TO_PF(pf->prev)->next = pf->next;
+    if (pf->next != PFN_INVALID)
+        PFN_TO_PF(pf->next)->prev = pf->prev;
+    lru.count[list]--;
+    pf->flags &= ~PFFLAG_LRU;
+}
+
+/// Reset the records of a block of 2^order page frames, preserving the NUMA
+/// node they belong to.
+static void
+pfreset(pf_t *pf, int order, uint8_t type)
+{
+    uint8_t node = pf->node;
+    memzero(pf, sizeof(pf_t) << order);
+    for (uint32_t i = 0; i < (1u << order); i++) {
+        pf[i].type = type;
+        pf[i].node = node;
+    }
+}
+
 /// Reserve an aligned region of memory managed by the memory table module.
 static void *
 reserve_region(const pmap_t *map, uint64_t size, uint32_t alignshift)
@@ -103,97 +381,478 @@ reserve_region(const pmap_t *map, uint64_t size, uint32_t alignshift)
     return NULL;
 }
 
+/// Call a function for each page frame database section containing usable
+/// memory, in address order.
+static void
+for_each_section(const pmap_t *map, void (*fn)(uint32_t s))
+{
+    uint64_t next = 0; // First section not yet visited
+    for (uint64_t r = 0; r < map->count; r++) {
+        const pmapregion_t *region = &map->region[r];
+        if (region->type != PMEMTYPE_USABLE)
+            continue;
+
+        uint64_t pfn  = (region->addr + PAGE_SIZE - 1) >> PAGE_SHIFT;
+        uint64_t pfnN = (region->addr + region->size) >> PAGE_SHIFT;
+        if (pfn >= pfnN)
+            continue;
+
+        uint64_t s  = max(next, pfn >> PFSECTION_SHIFT);
+        uint64_t sN = ((pfnN - 1) >> PFSECTION_SHIFT) + 1;
+        for (; s < sN; s++)
+            fn((uint32_t)s);
+        next = max(next, sN);
+    }
+}
+
+static void
+count_section(uint32_t s)
+{
+    (void)s;
+    pfdb.present++;
+}
+
+static void
+add_section(uint32_t s)
+{
+    pfdb.section[s]            = pfdb.present | PFSECTION_DEFERRED;
+    pfdb.secnum[pfdb.present++] = s;
+}
+
+/// Call a function for each naturally aligned block of usable frames in the
+/// range [pfn0, pfnN). Blocks are as large as possible without crossing a
+/// NUMA node boundary or the end of the range.
+static void
+for_each_block(uint64_t pfn0, uint64_t pfnN,
+               void (*fn)(uint64_t pfn, int order, int node))
+{
+    const pmap_t *map = pmap();
+    for (uint64_t r = 0; r < map->count; r++) {
+        const pmapregion_t *region = &map->region[r];
+        if (region->type != PMEMTYPE_USABLE)
+            continue;
+
+        uint64_t pfn  = (region->addr + PAGE_SIZE - 1) >> PAGE_SHIFT;
+        uint64_t term = (region->addr + region->size) >> PAGE_SHIFT;
+        pfn  = max(pfn, pfn0);
+        term = min(term, pfnN);
+        while (pfn < term) {
+            uint64_t nterm;
+            int      node  = numa_paddr_node(pfn << PAGE_SHIFT, &nterm);
+            uint64_t bterm = min(term, nterm >> PAGE_SHIFT);
+
+            int order = 0;
+            while (order < PFORDER_MAX &&
+                   (pfn & ((2ull << order) - 1)) == 0 &&
+                   pfn + (2ull << order) <= bterm)
+                order++;
+
+            fn(pfn, order, node);
+            pfn += 1ull << order;
+        }
+    }
+}
+
+/// Count a block of deferred frames as available.
+static void
+defer_block(uint64_t pfn, int order, int node)
+{
+    (void)pfn;
+    pfdb.node[node].avail    += 1u << order;
+    pfdb.node[node].deferred += 1u << order;
+    pfdb.avail               += 1u << order;
+    pfdb.deferred            += 1u << order;
+}
+
+static void
+freelist_insert(uint32_t pfn, int order);
+
+/// Initialize the records of a block of deferred frames, and add it to its
+/// node's available lists.
+static void
+init_block(uint64_t pfn, int order, int node)
+{
+    pf_t *pf = PFN_TO_PF(pfn);
+    for (uint64_t i = 0; i < (1ull << order); i++) {
+        pf[i].type = PFTYPE_AVAILABLE;
+        pf[i].node = (uint8_t)node;
+    }
+    freelist_insert((uint32_t)pfn, order);
+    pfdb.node[node].deferred -= 1u << order;
+    pfdb.deferred            -= 1u << order;
+}
+
+/// Initialize the records of the next deferred section in address order,
+/// making its usable frames available for allocation. Return false if no
+/// sections are deferred.
+static bool
+init_next_section()
+{
+    if (pfdb.next_deferred == pfdb.present)
+        return false;
+
+    uint32_t p = pfdb.next_deferred++;
+    uint32_t s = pfdb.secnum[p];
+    memzero(pfdb.pf + ((uint64_t)p << PFSECTION_SHIFT),
+            PFSECTION_FRAMES * sizeof(pf_t));
+    pfdb.section[s] = p;
+
+    uint64_t pfn = (uint64_t)s << PFSECTION_SHIFT;
+    for_each_block(pfn, min(pfn + PFSECTION_FRAMES, pfdb.count), init_block);
+
+    if (pfdb.next_deferred == pfdb.present) {
+        logf(LOG_INFO, "[page] Frame db fully initialized at TSC %lu.",
+             rdtsc());
+    }
+    return true;
+}
+
+/// Enable process-context identifiers if the CPU supports them.
+static void
+pcid_init()
+{
+    registers4_t regs;
+    cpuid(0, &regs);
+    uint64_t maxleaf = regs.rax;
+
+    cpuid(1, &regs);
+    if ((regs.rcx & CPUID1_ECX_PCID) == 0)
+        return;
+    if (maxleaf >= 7) {
+        cpuid(7, &regs);
+        pcids.invpcid = (regs.rbx & CPUID7_EBX_INVPCID) != 0;
+    }
+
+    // The kernel's page table is active with PCID 0, as required when
+    // enabling PCIDs.
+    set_cr4(get_cr4() | CPU_CR4_PCIDE);
+    pcids.enabled  = true;
+    pcids.owner[0] = &kpt;
+    pcids.next     = 1;
+
+    logf(LOG_INFO, "[page] PCIDs enabled (INVPCID %s).",
+         pcids.invpcid ? "supported" : "unsupported");
+}
+
+/// Return the CR3 value that activates a page table. A page table that
+/// still owns a PCID with valid TLB entries is activated without flushing
+/// them. Otherwise it's assigned a PCID, whose entries are flushed.
+static uint64_t
+pcid_cr3(pagetable_t *pt)
+{
+    if (!pcids.enabled) {
+        pgstats.pcid_misses++;
+        return pt->proot;
+    }
+
+    uint32_t pcid = pt->pcid;
+    if (pcids.owner[pcid] == pt && !pcids.stale[pcid]) {
+        pgstats.pcid_hits++;
+        return pt->proot | pcid | CPU_CR3_NOFLUSH;
+    }
+
+    // Recycle the next PCID, skipping the kernel's and the active table's.
+    if (pcids.owner[pcid] != pt) {
+        do {
+            pcid       = pcids.next;
+            pcids.next = pcid % (PCID_COUNT - 1) + 1;
+        } while (pcids.owner[pcid] == active_pt);
+        pcids.owner[pcid] = pt;
+        pt->pcid          = pcid;
+    }
+
+    pcids.stale[pcid] = false;
+    pgstats.pcid_misses++;
+    return pt->proot | pcid;
+}
+
+/// Mark the TLB entries of an inactive page table's PCID as stale, so
+/// they're flushed when the page table is next activated.
+static void
+pcid_invalidate(pagetable_t *pt)
+{
+    if (pcids.owner[pt->pcid] == pt)
+        pcids.stale[pt->pcid] = true;
+}
+
+static uint64_t
+pgalloc_order(int order);
+
+static void
+isr_page_fault(const interrupt_context_t *context);
+
 void
 page_init()
 {
+    uint64_t start = rdtsc();
+
     // Retrieve the physical memory map.
     const pmap_t *map = pmap();
     if (map->last_usable == 0)
         fatal();
 
-    // Calculate the size of the page frame database. It needs to describe
-    // each page up to and including the last physical address.
-    pfdb.count = map->last_usable / PAGE_SIZE;
-    uint64_t pfdbsize = pfdb.count * sizeof(pf_t);
+    // Divide the physical address range up to the last usable address into
+    // sections, and count the sections containing usable memory.
+    pfdb.count    = map->last_usable / PAGE_SIZE;
+    pfdb.sections = (pfdb.count + PFSECTION_FRAMES - 1) >> PFSECTION_SHIFT;
+    pfdb.present  = 0;
+    for_each_section(map, count_section);
+
+    // Calculate the size of the page frame database: frame records for each
+    // present section, followed by the section lookup tables.
+    uint64_t recsize  = (uint64_t)pfdb.present * PFSECTION_FRAMES *
+                        sizeof(pf_t);
+    uint64_t pfdbsize = recsize +
+                        (pfdb.sections + pfdb.present) * sizeof(uint32_t);
 
     // Round the database size up to the nearest 2MiB since we'll be using
     // large pages in the kernel page table to describe the database.
     pfdbsize  += PAGE_SIZE_LARGE - 1;
     pfdbsize >>= PAGE_SHIFT_LARGE;
     pfdbsize <<= PAGE_SHIFT_LARGE;
+    pfdb.size  = pfdbsize;
 
     // Find a contiguous, 2MiB-aligned region of memory large enough to hold
     // the entire pagedb.
     pfdb.pf = (pf_t *)reserve_region(map, pfdbsize, PAGE_SHIFT_LARGE);
     if (pfdb.pf == NULL)
         fatal();
+    pfdb.section = (uint32_t *)ptr_add(void, pfdb.pf, recsize);
+    pfdb.secnum  = pfdb.section + pfdb.sections;
 
     // Initialize the kernel's page table.
     kmem_init(&kpt);
     set_pagetable(kpt.proot);
-    active_pt = &kpt;
+    active_pt  = &kpt;
+    pagetables = &kpt;
+    pcid_init();
+
+    // Create the page frame database in the newly mapped virtual memory,
+    // assigning each present section the next packed record array.
+    for (uint32_t s = 0; s < pfdb.sections; s++)
+        pfdb.section[s] = PFSECTION_ABSENT;
+    pfdb.present = 0;
+    for_each_section(map, add_section);
+
+    logf(LOG_INFO,
+         "[page] Frame db: %luKiB for %u of %u sections (%luKiB if flat).",
+         pfdbsize >> 10, pfdb.present, pfdb.sections,
+         ((uint64_t)pfdb.count * sizeof(pf_t)) >> 10);
+
+    // Initialize the available block lists.
+    pfdb.avail = 0;
+    for (int n = 0; n < MAX_NUMA_NODES; n++) {
+        for (int o = 0; o < PFORDER_COUNT; o++)
+            pfdb.node[n].head[o] = PFN_INVALID;
+    }
+    lru.head[LRU_ACTIVE]   = PFN_INVALID;
+    lru.head[LRU_INACTIVE] = PFN_INVALID;
 
-    // Create the page frame database in the newly mapped virtual memory.
-    memzero(pfdb.pf, pfdbsize);
+    // Count the usable frames of every section as available, but leave
+    // the sections deferred. Their records are initialized on demand.
+    pfdb.deferred      = 0;
+    pfdb.next_deferred = 0;
+    for_each_block(0, pfdb.count, defer_block);
 
-    // Initialize available page frame list.
-    pfdb.avail = 0;
-    pfdb.head  = PFN_INVALID;
-    pfdb.tail  = PFN_INVALID;
+    // Allocate the shared zero page. Marking its frame reserved keeps it
+    // from ever being reference-counted, aged or freed.
+    zero_page = pgalloc_order(PFORDER_SMALL);
+    PADDR_TO_PF(zero_page)->type = PFTYPE_RESERVED;
 
-    // Traverse the memory table, adding page frame database entries for each
-    // region in the table.
-    for (uint64_t r = 0; r < map->count; r++) {
-        const pmapregion_t *region = &map->region[r];
+    // Make read-only pages read-only for the kernel too, so its writes to
+    // copy-on-write pages fault.
+    set_cr0(get_cr0() | CPU_CR0_WP);
 
-        // Ignore non-usable memory regions.
-        if (region->type != PMEMTYPE_USABLE)
-            continue;
+    // Install the page fault handler.
+    isr_set(EXCEPTION_PAGE_FAULT, isr_page_fault);
 
-        // Create a chain of available page frames.
-        uint64_t pfn0 = region->addr >> PAGE_SHIFT;
-        uint64_t pfnN = (region->addr + region->size) >> PAGE_SHIFT;
-        for (uint64_t pfn = pfn0; pfn < pfnN; pfn++) {
-            pf_t *pf = PFN_TO_PF(pfn);
-            pf->prev = pfn - 1;
-            pf->next = pfn + 1;
-            pf->type = PFTYPE_AVAILABLE;
-        }
+    logf(LOG_INFO, "[page] Initialized in %lu cycles, %u frames deferred.",
+         rdtsc() - start, pfdb.deferred);
+}
 
-        // Link the chain to the list of available frames.
-        if (pfdb.tail == PFN_INVALID)
-            pfdb.head = pfn0;
-        else
-            pfdb.pf[pfdb.tail].next = pfn0;
-        pfdb.pf[pfn0].prev     = pfdb.tail;
-        pfdb.pf[pfnN - 1].next = PFN_INVALID;
-        pfdb.tail              = pfnN - 1;
+/// Allocate a naturally aligned block of 2^order contiguous page frames from
+/// a NUMA node's buddy lists. Return NULL if no block is large enough.
+static pf_t *
+pfalloc_node(int n, int order)
+{
+    // Find the smallest available block that can satisfy the request.
+    // Initialize deferred sections until one provides a large enough block
+    // or none of the node's frames remain deferred.
+    struct pfnode *node = &pfdb.node[n];
+    int            o;
+    for (;;) {
+        o = order;
+        while (o < PFORDER_COUNT && node->head[o] == PFN_INVALID)
+            o++;
+        if (o < PFORDER_COUNT)
+            break;
+        if (node->deferred == 0 || !init_next_section())
+            return NULL;
+    }
 
-        // Update the total number of available frames.
-        pfdb.avail += (uint32_t)(pfnN - pfn0);
+    pf_t *pf = PFN_TO_PF(node->head[o]);
+    freelist_remove(pf, o);
+
+    // Split the block in half until it's the requested size, returning the
+    // upper half of each split to the available list of its order.
+    while (o > order) {
+        o--;
+        pf_t *buddy = pf + (1u << o);
+        buddy->flags = PFFLAG_HEAD;
+        buddy->order = (uint8_t)o;
+        freelist_push(buddy, o);
     }
 
-    // TODO: Install page fault handler
+    // Initialize the block's page frames.
+    pfreset(pf, order, PFTYPE_ALLOCATED);
+    pf->refcount = 1;
+    pf->flags    = PFFLAG_HEAD;
+    pf->order    = (uint8_t)order;
+
+    node->avail -= 1u << order;
+    pfdb.avail  -= 1u << order;
+    return pf;
 }
 
+/// Allocate a naturally aligned block of 2^order contiguous page frames,
+/// preferring the current CPU's NUMA node and falling back to other nodes
+/// in order of increasing distance. Return NULL if no block is large enough.
 static pf_t *
-pfalloc()
+pfalloc_order(int order)
+{
+    const uint8_t *fallback = numa_fallback(numa_cpu_node(cpu_index()));
+    for (int i = 0; i < numa_nodes(); i++) {
+        pf_t *pf = pfalloc_node(fallback[i], order);
+        if (pf != NULL)
+            return pf;
+    }
+    return NULL;
+}
+
+/// Return a block of 2^order page frames to the buddy allocator.
+static void
+pffree_order(pf_t *pf, int order)
 {
-    // For now, fatal out. Later, we'll add swapping.
-    if (pfdb.avail == 0)
+    if (pf->type != PFTYPE_ALLOCATED || pf->order != order)
         fatal();
 
-    // Grab the first available page frame from the database.
-    pf_t *pf = PFN_TO_PF(pfdb.head);
+    // Re-initialize the block's page frame records.
+    pfreset(pf, order, PFTYPE_AVAILABLE);
+    pfdb.node[pf->node].avail += 1u << order;
+    pfdb.avail                += 1u << order;
+
+    freelist_insert(PF_TO_PFN(pf), order);
+}
+
+/// Add an available block of 2^order page frames to its node's available
+/// lists, merging it with its free buddies into the largest block possible.
+/// Buddies in deferred sections are never merged, since their records
+/// aren't initialized.
+static void
+freelist_insert(uint32_t pfn, int order)
+{
+    // Merge with the buddy block as long as it is free, of the same order,
+    // and on the same NUMA node.
+    pf_t *pf = PFN_TO_PF(pfn);
+    while (order < PFORDER_MAX) {
+        uint32_t bpfn = pfn ^ (1u << order);
+        if (!PFN_VALID(bpfn))
+            break;
+
+        pf_t *buddy = PFN_TO_PF(bpfn);
+        if (buddy->type != PFTYPE_AVAILABLE ||
+            (buddy->flags & PFFLAG_HEAD) == 0 || buddy->order != order ||
+            buddy->node != pf->node)
+            break;
+
+        freelist_remove(buddy, order);
+        buddy->flags = 0;
+        buddy->order = 0;
+
+        pfn &= ~(1u << order);
+        order++;
+    }
+
+    // Add the merged block to the available list of its order.
+    pf        = PFN_TO_PF(pfn);
+    pf->flags = PFFLAG_HEAD;
+    pf->order = (uint8_t)order;
+    freelist_push(pf, order);
+}
+
+/// Refill a CPU's frame cache with a batch of frames from the buddy
+/// allocator.
+static void
+pfcache_refill(struct pfcache *cache)
+{
+    for (int i = 0; i < PFCACHE_BATCH; i++) {
+        pf_t *pf = pfalloc_order(0);
+        if (pf == NULL)
+            break;
+        pf->type     = PFTYPE_AVAILABLE;
+        pf->flags    = 0;
+        pf->refcount = 0;
+        cache->pfn[cache->count++] = PF_TO_PFN(pf);
+    }
+    cache->refills++;
+}
+
+/// Return the 'count' oldest frames in a CPU's frame cache to the buddy
+/// allocator, keeping the most recently freed (cache-hot) frames.
+static void
+pfcache_drain(struct pfcache *cache, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++) {
+        pf_t *pf = PFN_TO_PF(cache->pfn[i]);
+        pf->type = PFTYPE_ALLOCATED;
+        pffree_order(pf, 0);
+    }
+    cache->count -= count;
+    memmove(cache->pfn, cache->pfn + count,
+            cache->count * sizeof(uint32_t));
+    cache->drains++;
+}
+
+/// Return the number of frames free for allocation, including the frames
+/// held by the per-CPU caches and the pre-zeroed pool.
+static uint32_t
+pfavail()
+{
+    uint32_t avail = pfdb.avail + zpool.count;
+    for (int c = 0; c < MAX_CPUS; c++)
+        avail += pfcache[c].count;
+    return avail;
+}
+
+static void
+swap_reclaim();
 
-    // Update the available frame list.
-    pfdb.head = pfdb.pf[pfdb.head].next;
-    if (pfdb.head != PFN_INVALID)
-        pfdb.pf[pfdb.head].prev = PFN_INVALID;
+static pf_t *
+pfalloc()
+{
+    // Refill this CPU's frame cache from the buddy allocator if it's empty.
+    // If the allocator is exhausted, swap out cold pages and try again. The
+    // frames they free land in this CPU's cache.
+    struct pfcache *cache = &pfcache[cpu_index()];
+    if (cache->count == 0) {
+        pfcache_refill(cache);
+        if (cache->count == 0) {
+            swap_reclaim();
+            if (cache->count == 0)
+                pfcache_refill(cache);
+        }
+        if (cache->count == 0)
+            fatal();
+    }
+    else {
+        cache->hits++;
+    }
 
-    // Initialize and return the page frame.
-    memzero(pf, sizeof(pf_t));
+    // Initialize and return the most recently cached page frame.
+    uint32_t pfn = cache->pfn[--cache->count];
+    pf_t    *pf  = PFN_TO_PF(pfn);
     pf->refcount = 1;
+    pf->flags    = PFFLAG_HEAD;
     pf->type     = PFTYPE_ALLOCATED;
     return pf;
 }
@@ -201,43 +860,109 @@ pfalloc()
 static void
 pffree(pf_t *pf)
 {
-    if (pf->type != PFTYPE_ALLOCATED)
+    if (pf->type != PFTYPE_ALLOCATED || pf->order != 0)
         fatal();
 
-    // Re-initialize the page frame record.
-    memzero(pf, sizeof(pf_t));
-    pf->prev = PFN_INVALID;
-    pf->next = pfdb.head;
-    pf->type = PFTYPE_AVAILABLE;
+    // Return frames from remote NUMA nodes directly to their node, so the
+    // cache only ever holds local memory.
+    int cpu = cpu_index();
+    if (pf->node != numa_cpu_node(cpu)) {
+        pffree_order(pf, 0);
+        return;
+    }
 
-    // Update the database's available frame list.
-    uint32_t pfn = PF_TO_PFN(pf);
-    pfdb.pf[pfdb.head].prev = pfn;
-    pfdb.head               = pfn;
+    // Make room in this CPU's frame cache if it's full.
+    struct pfcache *cache = &pfcache[cpu];
+    if (cache->count == PFCACHE_SIZE)
+        pfcache_drain(cache, PFCACHE_BATCH);
+    else
+        cache->hits++;
 
-    pfdb.avail++;
+    // Re-initialize the page frame record and cache it.
+    pfreset(pf, 0, PFTYPE_AVAILABLE);
+    cache->pfn[cache->count++] = PF_TO_PFN(pf);
 }
 
 static uint64_t
 pgalloc()
 {
-    // Allocate a page frame from the db and compute its physical address.
+    swap_reclaim();
+    memacct.allocs++;
+
+    // Newly allocated pages must always be zeroed, so prefer a frame that
+    // was zeroed while the CPU was idle.
+    if (zpool.count > 0) {
+        zpool.hits++;
+        return PFN_TO_PADDR(zpool.pfn[--zpool.count]);
+    }
+
+    // Otherwise allocate a page frame from the db and zero it now.
+    zpool.misses++;
     pf_t    *pf    = pfalloc();
     uint64_t paddr = PF_TO_PADDR(pf);
-
-    // Always zero the contents of newly allocated pages.
     memzero((void *)paddr, PAGE_SIZE);
 
     // Return the page's physical address.
     return paddr;
 }
 
+/// Allocate a zeroed, naturally aligned block of 2^order page frames and
+/// return its physical address.
+static uint64_t
+pgalloc_order(int order)
+{
+    // If no block is large enough, swap out cold pages and return the
+    // frames they free from this CPU's cache to the buddy lists, where
+    // they can merge into larger blocks. Then try again.
+    pf_t *pf = pfalloc_order(order);
+    if (pf == NULL) {
+        struct pfcache *cache = &pfcache[cpu_index()];
+        swap_reclaim();
+        if (cache->count > 0)
+            pfcache_drain(cache, cache->count);
+        pf = pfalloc_order(order);
+    }
+    if (pf == NULL)
+        fatal();
+    memacct.allocs += 1ull << order;
+
+    uint64_t paddr = PF_TO_PADDR(pf);
+    memzero((void *)paddr, (uint64_t)PAGE_SIZE << order);
+    return paddr;
+}
+
 static void
 pgfree(uint64_t paddr)
 {
     pf_t *pf = PADDR_TO_PF(paddr);
-    if (--pf->refcount == 0)
-        pffree(pf);
+    if (--pf->refcount == 0) {
+        memacct.frees += 1ull << pf->order;
+        lru_remove(pf);
+        if (pf->order == 0)
+            pffree(pf);
+        else
+            pffree_order(pf, pf->order);
+    }
+}
+
+/// Release the reference a leaf page table entry holds on its page frame.
+static void
+pgfree_pte(uint64_t pte)
+{
+    // Swapped out pages hold a reference to their compressed copy.
+    if ((pte & (PF_PRESENT | PF_SWAP)) == PF_SWAP) {
+        zswap_free(PTE_TO_SLOT(pte));
+        return;
+    }
+
+    // Reserved pages that were never written have no frame to free.
+    uint64_t paddr = PTE_TO_PADDR(pte);
+    if (paddr == 0 || paddr == zero_page)
+        return;
+
+    if (pte & PF_COW)
+        PADDR_TO_PF(paddr)->sharecount--;
+    pgfree(paddr);
 }
 
 static void
@@ -247,12 +972,16 @@ pgfree_recurse(page_t *page, int level)
     // database.
     if (level == 1) {
         for (uint64_t e = 0; e < 512; e++) {
+            if ((page->entry[e] & (PF_PRESENT | PF_SWAP)) == PF_SWAP) {
+                pgfree_pte(page->entry[e]);
+                continue;
+            }
             uint64_t paddr = PTE_TO_PADDR(page->entry[e]);
             if (paddr == 0)
                 continue;
-            pf_t *pf = PADDR_TO_PF(paddr);
-            if (pf->type == PFTYPE_ALLOCATED)
-                pgfree(paddr);
+            if (PADDR_VALID(paddr) &&
+                PADDR_TO_PF(paddr)->type == PFTYPE_ALLOCATED)
+                pgfree_pte(page->entry[e]);
         }
     }
 
@@ -262,6 +991,17 @@ pgfree_recurse(page_t *page, int level)
         for (uint64_t e = 0; e < 512; e++) {
             if (page->entry[e] & PF_SYSTEM) // Never free system tables
                 continue;
+
+            // Large (PD) and huge (PDPT) pages are leaves, so return them
+            // to the page frame database.
+            if (page->entry[e] & PF_PS) {
+                uint64_t paddr = PTE_TO_PADDR(page->entry[e]);
+                if (PADDR_VALID(paddr) &&
+                    PADDR_TO_PF(paddr)->type == PFTYPE_ALLOCATED)
+                    pgfree_pte(page->entry[e]);
+                continue;
+            }
+
             page_t *child = PGPTR(page->entry[e]);
             if (child == NULL)
                 continue;
@@ -270,94 +1010,676 @@ pgfree_recurse(page_t *page, int level)
     }
 }
 
-/// Add to the page table an entry mapping a virtual address to a physical
-/// address.
+/// Flush all TLB entries of a page table. The kernel's pages are global and
+/// survive page table switches, so flushing them flushes every PCID.
 static void
-add_pte(pagetable_t *pt, uint64_t vaddr, uint64_t paddr, uint32_t pflags,
-        uint32_t addflags)
+tlb_flush_all(pagetable_t *pt)
 {
-    // Fatal out if virtual address space is exhausted.
-    if ((addflags & CONTAINS_TABLE) && (vaddr >= pt->vterm))
-        fatal();
+    if (pt == &kpt) {
+        if (pcids.invpcid) {
+            invalidate_pcid(INVPCID_ALL_GLOBAL, 0, NULL);
+        }
+        else {
+            uint64_t cr4 = get_cr4();
+            set_cr4(cr4 & ~CPU_CR4_PGE);
+            set_cr4(cr4);
+        }
+        pgstats.tlb_full_flushes++;
+        return;
+    }
 
-    // Keep track of the pages we add to the page table as we add this new
-    // page table entry.
-    uint64_t added[3];
-    int      count = 0;
+    if (pt != active_pt) {
+        pcid_invalidate(pt);
+        return;
+    }
 
-    // Decompose the virtual address into its hierarchical table components.
-    uint32_t pml4e = PML4E(vaddr);
-    uint32_t pdpte = PDPTE(vaddr);
-    uint32_t pde   = PDE(vaddr);
-    uint32_t pte   = PTE(vaddr);
+    set_pagetable(pcids.enabled ? pt->proot | pt->pcid : pt->proot);
+    pgstats.tlb_full_flushes++;
+}
 
-    // Follow the page table hierarchy down to the lowest level, creating
-    // new pages for tables as needed.
+static void
+tlb_batch_init(struct tlbbatch *batch, pagetable_t *pt)
+{
+    batch->pt    = pt;
+    batch->count = 0;
+}
 
-    page_t *pml4t = (page_t *)pt->proot;
-    if (pml4t->entry[pml4e] == 0) {
-        uint64_t pgaddr = pgalloc();
-        added[count++]      = pgaddr;
-        pml4t->entry[pml4e] = pgaddr | PF_PRESENT | PF_RW;
-    }
-    else if (pml4t->entry[pml4e] & PF_SYSTEM) {
-        // A system page table should never be modified. This check is
-        // performed only within the root PML4 table because checks on
-        // lower level tables would be redundant.
-        fatal();
+/// Add a page of any size to a TLB batch. A single invlpg invalidates a
+/// large or huge page's entry, so each counts as one page.
+static void
+tlb_batch_add(struct tlbbatch *batch, uint64_t vaddr)
+{
+    if (batch->count < TLB_FLUSH_THRESHOLD)
+        batch->vaddr[batch->count] = vaddr;
+    batch->count++;
+}
+
+/// Add each small page of a range to a TLB batch, stopping once the batch
+/// will be committed with a full flush anyway.
+static void
+tlb_batch_add_range(struct tlbbatch *batch, uint64_t vaddr, uint64_t size)
+{
+    for (uint64_t off = 0;
+         off < size && batch->count <= TLB_FLUSH_THRESHOLD; off += PAGE_SIZE)
+        tlb_batch_add(batch, vaddr + off);
+}
+
+/// Invalidate the TLB entries of all pages in a batch. A few pages are
+/// invalidated one at a time. More than that are cheaper to flush all at
+/// once, since refilling the TLB costs less than many invlpgs.
+static void
+tlb_batch_commit(struct tlbbatch *batch)
+{
+    pagetable_t *pt = batch->pt;
+    if (batch->count == 0)
+        return;
+
+    if (batch->count > TLB_FLUSH_THRESHOLD) {
+        tlb_flush_all(pt);
+    }
+    else if (pt == active_pt || pt == &kpt) {
+        // The kernel's mappings are shared by every page table, and invlpg
+        // invalidates global entries in every PCID.
+        for (uint32_t i = 0; i < batch->count; i++)
+            invalidate_page((void *)batch->vaddr[i]);
+        pgstats.tlb_page_flushes += batch->count;
+    }
+    else if (pcids.invpcid && pcids.owner[pt->pcid] == pt) {
+        // An inactive page table's entries may still be cached under its
+        // PCID.
+        for (uint32_t i = 0; i < batch->count; i++) {
+            invalidate_pcid(INVPCID_ADDRESS, pt->pcid,
+                            (void *)batch->vaddr[i]);
+        }
+        pgstats.tlb_page_flushes += batch->count;
+    }
+    else {
+        pcid_invalidate(pt);
     }
+    batch->count = 0;
+}
 
-    page_t *pdpt = PGPTR(pml4t->entry[pml4e]);
-    if (pdpt->entry[pdpte] == 0) {
-        uint64_t pgaddr = pgalloc();
-        added[count++]     = pgaddr;
-        pdpt->entry[pdpte] = pgaddr | PF_PRESENT | PF_RW;
+/// Return the record of the frame mapped by a present small-page entry, or
+/// NULL if the frame isn't managed by the page frame database.
+static pf_t *
+lru_frame(const pagetable_t *pt, uint64_t pte, uint64_t vaddr)
+{
+    // The page table's own pages are never aged.
+    if (vaddr >= pt->vroot && vaddr < pt->vterm)
+        return NULL;
+
+    uint64_t paddr = PTE_TO_PADDR(pte);
+    if (!PADDR_VALID(paddr))
+        return NULL;
+    pf_t *pf = PADDR_TO_PF(paddr);
+    return (pf->type == PFTYPE_ALLOCATED) ? pf : NULL;
+}
+
+/// Age a page by clearing its accessed flag. A referenced frame moves to the
+/// active list, and an unreferenced one to the inactive list. Return true if
+/// the frame was already inactive and is still unreferenced.
+///
+/// The page's TLB entry is invalidated along with the flag, since the CPU
+/// only sets the flag again when it walks the page table.
+static bool
+lru_age(pf_t *pf, uint64_t *pte, uint64_t vaddr, struct tlbbatch *batch)
+{
+    if (*pte & PF_ACCESS) {
+        *pte &= ~PF_ACCESS;
+        tlb_batch_add(batch, vaddr);
+        if ((pf->flags & PFFLAG_ACTIVE) == 0) {
+            lru_remove(pf);
+            lru_push(pf, LRU_ACTIVE);
+            pgstats.lru_activations++;
+        }
+        return false;
     }
 
-    page_t *pdt = PGPTR(pdpt->entry[pdpte]);
-    if (pdt->entry[pde] == 0) {
-        uint64_t pgaddr = pgalloc();
-        added[count++]  = pgaddr;
-        pdt->entry[pde] = pgaddr | PF_PRESENT | PF_RW;
+    if (pf->flags & PFFLAG_INACTIVE)
+        return true;
+
+    lru_remove(pf);
+    lru_push(pf, LRU_INACTIVE);
+    pgstats.lru_deactivations++;
+    return false;
+}
+
+/// Hash the contents of a page. Only pages of zeros are likely to hash to 0.
+static uint64_t
+merge_hash(const uint64_t *page)
+{
+    uint64_t hash = 0;
+    for (int i = 0; i < PAGE_SIZE / 8; i++)
+        hash = (hash ^ page[i]) * 0x100000001b3ull;
+    return hash ^ (hash >> 32);
+}
+
+/// Merge a private, writable page with an identical page found in the merge
+/// table or with the zero page, freeing its frame. If there's no identical
+/// page, write-protect the page instead and add it to the merge table, so
+/// later pages can be merged with it.
+static void
+merge_page(uint64_t *pte, uint64_t vaddr, pf_t *pf, struct tlbbatch *batch)
+{
+    uint64_t entry = *pte;
+    uint64_t paddr = PTE_TO_PADDR(entry);
+    uint64_t hash  = merge_hash((const uint64_t *)paddr);
+    uint32_t b     = (uint32_t)hash & (MERGE_BUCKETS - 1);
+    pgstats.merge_hashes++;
+
+    // A page can only be merged with a frame whose every mapping is
+    // read-only copy-on-write, since its contents can't then change.
+    uint64_t target = 0;
+    if (hash == 0 && !memcmp((const void *)paddr, (const void *)zero_page,
+                             PAGE_SIZE)) {
+        target = zero_page;
+    }
+    else if (merge.hash[b] == hash && PFN_VALID(merge.pfn[b])) {
+        uint32_t pfn = merge.pfn[b];
+        pf_t    *tpf = PFN_TO_PF(pfn);
+        if (tpf != pf && tpf->type == PFTYPE_ALLOCATED && tpf->order == 0 &&
+            tpf->sharecount > 0 && tpf->sharecount == tpf->refcount &&
+            !memcmp((const void *)paddr, (const void *)PFN_TO_PADDR(pfn),
+                    PAGE_SIZE)) {
+            target = PFN_TO_PADDR(pfn);
+            tpf->refcount++;
+            tpf->sharecount++;
+        }
     }
 
-    // Add the page table entry.
-    page_t *ptt = PGPTR(pdt->entry[pde]);
-    ptt->entry[pte] = paddr | pflags;
+    uint64_t pflags = (entry & PGMASK_OFFSET & ~PF_RW) | PF_COW;
+    if (target != 0) {
+        *pte = target | pflags;
+        pgfree(paddr);
+        pgstats.merge_pages++;
+    }
+    else {
+        *pte = paddr | pflags;
+        pf->sharecount++;
+        merge.hash[b] = hash;
+        merge.pfn[b]  = PF_TO_PFN(pf);
+    }
+    tlb_batch_add(batch, vaddr);
+}
 
-    // If adding the new entry required the page table to grow, make sure to
-    // add the page table's new pages as well.
-    for (int i = 0; i < count; i++) {
-        add_pte(pt, pt->vnext, added[i], PF_PRESENT | PF_RW, CONTAINS_TABLE);
-        pt->vnext += PAGE_SIZE;
+/// Age the small pages mapped beneath a table page, starting at the reclaim
+/// scanner's hand. Pages unreferenced for a full sweep are passed to the
+/// merger if it's enabled. Return false if the budget of entries ran out
+/// first.
+static bool
+lru_walk(page_t *page, int level, uint64_t vbase, int *budget,
+         struct tlbbatch *batch)
+{
+    int shift = PGSHIFT_PTE + 9 * (level - 1);
+    for (uint64_t e = 0; e < 512; e++) {
+        uint64_t entry = page->entry[e];
+        uint64_t vaddr = vbase | (e << shift);
+        if (vaddr + (1ull << shift) <= lru.hand)
+            continue;
+        if ((entry & PF_PRESENT) == 0 || (entry & PF_SYSTEM))
+            continue;
+
+        // Large and huge pages are never aged.
+        if (level > 1) {
+            if ((entry & PF_PS) == 0 &&
+                !lru_walk(PGPTR(entry), level - 1, vaddr, budget, batch))
+                return false;
+            continue;
+        }
+
+        if (*budget == 0)
+            return false;
+        (*budget)--;
+        lru.hand = vaddr + PAGE_SIZE;
+
+        pf_t *pf = lru_frame(lru.pt, entry, CANONICAL(vaddr));
+        if (pf == NULL)
+            continue;
+        lru.rss++;
+        if (entry & PF_ACCESS)
+            lru.wss++;
+        pgstats.lru_scans++;
+
+        // Pages that are already copy-on-write are left alone by the
+        // merger, since they're either shared or merge candidates.
+        bool cold = lru_age(pf, &page->entry[e], CANONICAL(vaddr), batch);
+        if (cold && merge.enabled && pf->refcount == 1 &&
+            (entry & (PF_RW | PF_COW)) == PF_RW)
+            merge_page(&page->entry[e], CANONICAL(vaddr), pf, batch);
     }
+    return true;
 }
 
-static uint64_t
-remove_pte(pagetable_t *pt, uint64_t vaddr)
+/// Advance the reclaim scanner by a batch of page table entries. A sweep of
+/// the registered page tables starts at most once every LRU_PERIOD cycles,
+/// so the pages a sweep finds referenced estimate each table's working set
+/// over that period.
+static void
+lru_scan()
+{
+    if (lru.pt == NULL) {
+        uint64_t now = rdtsc();
+        if (now - lru.start < LRU_PERIOD)
+            return;
+        lru.start = now;
+        lru.pt    = pagetables;
+        lru.hand  = 0;
+    }
+
+    int budget = LRU_BATCH;
+    while (lru.pt != NULL) {
+        struct tlbbatch batch;
+        tlb_batch_init(&batch, lru.pt);
+        bool swept = lru_walk((page_t *)lru.pt->proot, 4, 0, &budget,
+                              &batch);
+        tlb_batch_commit(&batch);
+        if (!swept)
+            break;
+
+        // The table has been swept, so publish its estimates and move on
+        // to the next one.
+        lru.pt->rss = lru.rss;
+        lru.pt->wss = lru.wss;
+        pgstats.lru_sweeps++;
+        lru.pt   = lru.pt->next;
+        lru.hand = 0;
+        lru.rss  = 0;
+        lru.wss  = 0;
+    }
+}
+
+/// The state of a scan for cold pages to swap out.
+struct swapscan
+{
+    pagetable_t     *pt;          ///< Page table being scanned
+    uint64_t         start;       ///< First address to scan
+    uint64_t         term;        ///< Just beyond the last address to scan
+    uint64_t         hand;        ///< Just beyond the last page scanned
+    int              count;       ///< Pages still to be swapped out
+    struct tlbbatch *batch;       ///< Pages swapped out
+};
+
+/// Swap out a page if it's private, cold and compressible. The page is aged
+/// as it's scanned, and it's cold if an earlier scan left it on the inactive
+/// list and it hasn't been referenced since.
+static void
+swap_page(struct swapscan *scan, uint64_t *pte, uint64_t vaddr)
 {
+    // Leave shared pages alone.
+    uint64_t entry = *pte;
+    if (entry & PF_COW)
+        return;
+    pf_t *pf = lru_frame(scan->pt, entry, vaddr);
+    if (pf == NULL || pf->refcount != 1 ||
+        !lru_age(pf, pte, vaddr, scan->batch))
+        return;
+
+    uint64_t paddr = PTE_TO_PADDR(entry);
+    uint32_t slot = zswap_store((const void *)paddr);
+    if (slot == 0)
+        return;
+
+    *pte = ((uint64_t)slot << PAGE_SHIFT) | (entry & SWAP_FLAGS) | PF_SWAP;
+    tlb_batch_add(scan->batch, vaddr);
+    pgfree(paddr);
+
+    scan->count--;
+    pgstats.swap_outs++;
+}
+
+/// Scan the small pages mapped beneath a table page for pages to swap out.
+static void
+swap_walk(struct swapscan *scan, page_t *page, int level, uint64_t vbase)
+{
+    int shift = PGSHIFT_PTE + 9 * (level - 1);
+    for (uint64_t e = 0; e < 512 && scan->count > 0; e++) {
+        uint64_t entry = page->entry[e];
+        uint64_t vaddr = vbase | (e << shift);
+        uint64_t vterm = vaddr + (1ull << shift);
+        if (vterm <= scan->start || vaddr >= scan->term)
+            continue;
+        if ((entry & PF_PRESENT) == 0 || (entry & PF_SYSTEM))
+            continue;
+
+        // Large and huge pages are never swapped out.
+        if (level > 1) {
+            if ((entry & PF_PS) == 0)
+                swap_walk(scan, PGPTR(entry), level - 1, vaddr);
+            continue;
+        }
+
+        swap_page(scan, &page->entry[e], CANONICAL(vaddr));
+        scan->hand = vterm;
+    }
+}
+
+/// Swap out up to 'count' cold pages of a page table, and return the number
+/// of pages still to be swapped out. The scan resumes where the table's last
+/// one stopped, and sweeps the table at most once, so a page is only
+/// swapped out if it went unreferenced since an earlier scan aged it.
+static int
+swap_out(pagetable_t *pt, int count)
+{
+    struct tlbbatch batch;
+    tlb_batch_init(&batch, pt);
+
+    struct swapscan scan =
+    {
+        .pt = pt, .hand = pt->hand, .count = count, .batch = &batch
+    };
+
+    const uint64_t vlimit = 1ull << 48;
+    for (int half = 0; half < 2 && scan.count > 0; half++) {
+        scan.start = (half == 0) ? pt->hand : 0;
+        scan.term  = (half == 0) ? vlimit : pt->hand;
+        swap_walk(&scan, (page_t *)pt->proot, 4, 0);
+    }
+
+    pt->hand = scan.hand;
+    tlb_batch_commit(&batch);
+    return scan.count;
+}
+
+/// Swap out cold pages when free frames run low, starting with the active
+/// page table and moving on to the other registered tables if necessary.
+///
+/// A reclaim that neither swaps out nor deactivates a page has nothing to
+/// work with. Rescanning every table on each later allocation would then
+/// make allocations cost as much as a sweep, so reclaim waits until a frame
+/// is freed or SWAP_RETRY more frames have been allocated, either of which
+/// may have produced new candidates.
+static void
+swap_reclaim()
+{
+    if (swapping || pfavail() >= SWAP_WATERMARK)
+        return;
+    if (swap_stalled && memacct.frees == swap_stall_frees &&
+        memacct.allocs - swap_stall_allocs < SWAP_RETRY)
+        return;
+
+    uint64_t outs          = pgstats.swap_outs;
+    uint64_t deactivations = pgstats.lru_deactivations;
+
+    swapping = true;
+    int count = swap_out(active_pt, SWAP_BATCH);
+    for (pagetable_t *pt = pagetables; pt != NULL; pt = pt->next) {
+        if (count == 0)
+            break;
+        if (pt != active_pt)
+            count = swap_out(pt, count);
+    }
+    swapping = false;
+
+    swap_stalled = (pgstats.swap_outs == outs &&
+                    pgstats.lru_deactivations == deactivations);
+    swap_stall_allocs = memacct.allocs;
+    swap_stall_frees  = memacct.frees;
+}
+
+/// Return a pointer to the leaf entry mapping a virtual address, or NULL if
+/// no table covers the address. The order of the page mapped by the entry
+/// (small, large or huge) is returned in 'order'.
+static uint64_t *
+find_pte(pagetable_t *pt, uint64_t vaddr, int *order)
+{
+    page_t *pml4t = (page_t *)pt->proot;
+    if ((pml4t->entry[PML4E(vaddr)] & PF_PRESENT) == 0)
+        return NULL;
+
+    page_t   *pdpt  = PGPTR(pml4t->entry[PML4E(vaddr)]);
+    uint64_t *entry = &pdpt->entry[PDPTE(vaddr)];
+    *order = PFORDER_HUGE;
+    if ((*entry & PF_PS) || (*entry & PF_PRESENT) == 0)
+        return (*entry & PF_PRESENT) ? entry : NULL;
+
+    page_t *pdt = PGPTR(*entry);
+    entry  = &pdt->entry[PDE(vaddr)];
+    *order = PFORDER_LARGE;
+    if ((*entry & PF_PS) || (*entry & PF_PRESENT) == 0)
+        return (*entry & PF_PRESENT) ? entry : NULL;
+
+    page_t *ptt = PGPTR(*entry);
+    *order = PFORDER_SMALL;
+    return &ptt->entry[PTE(vaddr)];
+}
+
+/// Resolve a fault on a page reserved with page_reserve. A read maps the
+/// shared zero page, copy-on-write if the page is writable, and a write
+/// allocates a frame for the page. Return true if the fault was resolved.
+static bool
+demand_fault(uint64_t *pte, int order, bool write)
+{
+    if (order != PFORDER_SMALL || (*pte & PF_PRESENT) ||
+        (*pte & PF_DEMAND) == 0)
+        return false;
+
+    // Keep the access flags requested when the page was reserved. Pages
+    // that were never present aren't cached by the TLB, so no invalidation
+    // is necessary.
+    uint64_t pflags = *pte & PGMASK_OFFSET & ~PF_DEMAND;
+    if (!write) {
+        if (pflags & PF_RW)
+            pflags = (pflags & ~PF_RW) | PF_COW;
+        *pte = zero_page | pflags | PF_PRESENT;
+        pgstats.zero_faults++;
+        return true;
+    }
+
+    *pte = pgalloc() | pflags | PF_PRESENT;
+    return true;
+}
+
+/// Resolve a fault on a swapped out page by decompressing it into a new
+/// frame. Return true if the fault was resolved.
+static bool
+swap_in(uint64_t *pte, int order)
+{
+    if (order != PFORDER_SMALL || (*pte & (PF_PRESENT | PF_SWAP)) != PF_SWAP)
+        return false;
+
+    swap_reclaim();
+
+    uint32_t slot  = PTE_TO_SLOT(*pte);
+    pf_t    *pf    = pfalloc();
+    uint64_t paddr = PF_TO_PADDR(pf);
+    zswap_load(slot, (void *)paddr);
+    zswap_free(slot);
+    memacct.allocs++;
+
+    *pte = paddr | (*pte & SWAP_FLAGS) | PF_PRESENT;
+    pgstats.swap_ins++;
+    return true;
+}
+
+/// Resolve a write fault on a copy-on-write page by giving the faulting
+/// page table its own writable copy of the page. If no other page table
+/// still shares the frame, take ownership of it instead of copying. Return
+/// true if the fault was resolved.
+static bool
+cow_fault(uint64_t vaddr, uint64_t *pte, int order)
+{
+    if ((*pte & (PF_PRESENT | PF_COW)) != (PF_PRESENT | PF_COW))
+        return false;
+
+    uint64_t paddr = PTE_TO_PADDR(*pte);
+    pf_t    *pf    = PADDR_TO_PF(paddr);
+
+    // Writes to the zero page get a freshly zeroed page of their own.
+    if (paddr == zero_page) {
+        paddr = pgalloc();
+        pgstats.cow_copies++;
+    }
+    else if (pf->refcount > 1) {
+        pf_t *copy = (order == PFORDER_SMALL) ? pfalloc()
+                                              : pfalloc_order(order);
+        if (copy == NULL)
+            fatal();
+        memcpy((void *)PF_TO_PADDR(copy), (const void *)paddr,
+               (uint64_t)PAGE_SIZE << order);
+        memacct.allocs += 1ull << order;
+        pf->sharecount--;
+        pf->refcount--;
+        paddr = PF_TO_PADDR(copy);
+        pgstats.cow_copies++;
+    }
+    else {
+        pf->sharecount--;
+        pgstats.cow_reuses++;
+    }
+
+    *pte = paddr | (*pte & PGMASK_OFFSET & ~PF_COW) | PF_RW;
+    invalidate_page((void *)(vaddr & ~(((uint64_t)PAGE_SIZE << order) - 1)));
+    pgstats.tlb_page_flushes++;
+    return true;
+}
+
+static void
+isr_page_fault(const interrupt_context_t *context)
+{
+    uint64_t start = rdtsc();
+    uint64_t vaddr = get_pagefault_addr();
+
+    // Protection violations can only be resolved if they're writes to
+    // copy-on-write pages. Accesses to non-present pages can only be
+    // resolved if the pages were swapped out or reserved.
+    int       order;
+    uint64_t *pte = find_pte(active_pt, vaddr, &order);
+    if (pte != NULL && (context->error & PFERR_PRESENT)) {
+        if ((context->error & PFERR_WRITE) && cow_fault(vaddr, pte, order))
+            return;
+    }
+    else if (pte != NULL && swap_in(pte, order)) {
+        return;
+    }
+    else if (pte != NULL &&
+             demand_fault(pte, order, (context->error & PFERR_WRITE) != 0)) {
+        uint64_t cycles = rdtsc() - start;
+        pgstats.demand_faults++;
+        pgstats.demand_cycles    += cycles;
+        pgstats.demand_max_cycles = max(pgstats.demand_max_cycles, cycles);
+        return;
+    }
+
+    exception_fatal(context);
+}
+
+/// Add to the page table an entry mapping a virtual address to a physical
+/// address.
+static void
+add_pte(pagetable_t *pt, uint64_t vaddr, uint64_t paddr, uint64_t pflags,
+        uint32_t addflags)
+{
+    // Fatal out if virtual address space is exhausted.
+    if ((addflags & CONTAINS_TABLE) && (vaddr >= pt->vterm))
+        fatal();
+
+    // Keep track of the pages we add to the page table as we add this new
+    // page table entry.
+    uint64_t added[3];
+    int      count = 0;
+
     // Decompose the virtual address into its hierarchical table components.
     uint32_t pml4e = PML4E(vaddr);
     uint32_t pdpte = PDPTE(vaddr);
     uint32_t pde   = PDE(vaddr);
     uint32_t pte   = PTE(vaddr);
 
-    // Traverse the hierarchy, looking for the page.
+    // Follow the page table hierarchy down to the lowest level, creating
+    // new pages for tables as needed.
+
     page_t *pml4t = (page_t *)pt->proot;
-    page_t *pdpt  = PGPTR(pml4t->entry[pml4e]);
-    page_t *pdt   = PGPTR(pdpt->entry[pdpte]);
-    page_t *ptt   = PGPTR(pdt->entry[pde]);
-    page_t *pg    = PGPTR(ptt->entry[pte]);
+    if (pml4t->entry[pml4e] == 0) {
+        uint64_t pgaddr = pgalloc();
+        added[count++]      = pgaddr;
+        pml4t->entry[pml4e] = pgaddr | PF_PRESENT | PF_RW;
+    }
+    else if (pml4t->entry[pml4e] & PF_SYSTEM) {
+        // A system page table should never be modified. This check is
+        // performed only within the root PML4 table because checks on
+        // lower level tables would be redundant.
+        fatal();
+    }
 
-    // Clear the page table entry for the virtual address.
-    ptt->entry[pte] = 0;
+    // Huge pages are mapped directly by the PDPT entry.
+    page_t *pdpt = PGPTR(pml4t->entry[pml4e]);
+    if (addflags & HUGE_PAGE) {
+        if (pdpt->entry[pdpte] != 0)
+            fatal();
+        pdpt->entry[pdpte] = paddr | pflags | PF_PS;
+    }
+    else {
+        if (pdpt->entry[pdpte] == 0) {
+            uint64_t pgaddr = pgalloc();
+            added[count++]     = pgaddr;
+            pdpt->entry[pdpte] = pgaddr | PF_PRESENT | PF_RW;
+        }
+        else if (pdpt->entry[pdpte] & PF_PS) {
+            // The address is already mapped by a huge page.
+            fatal();
+        }
 
-    // Invalidate the TLB entry for the page that was just removed.
-    if (pt == active_pt)
-        invalidate_page((void *)vaddr);
+        // Large pages are mapped directly by the PD entry.
+        page_t *pdt = PGPTR(pdpt->entry[pdpte]);
+        if (addflags & LARGE_PAGE) {
+            if (pdt->entry[pde] != 0)
+                fatal();
+            pdt->entry[pde] = paddr | pflags | PF_PS;
+        }
+        else {
+            if (pdt->entry[pde] == 0) {
+                uint64_t pgaddr = pgalloc();
+                added[count++]  = pgaddr;
+                pdt->entry[pde] = pgaddr | PF_PRESENT | PF_RW;
+            }
+            else if (pdt->entry[pde] & PF_PS) {
+                // The address is already mapped by a large page.
+                fatal();
+            }
+
+            // Add the page table entry.
+            page_t *ptt = PGPTR(pdt->entry[pde]);
+            ptt->entry[pte] = paddr | pflags;
+        }
+    }
 
-    // Return the physical address of the page table entry that was removed.
-    return (uint64_t)pg;
+    // If adding the new entry required the page table to grow, make sure to
+    // add the page table's new pages as well.
+    // Reserve each page's virtual address before mapping it, since mapping
+    // it may itself require more table pages.
+    memacct.table_pages += count;
+    for (int i = 0; i < count; i++) {
+        uint64_t vnext = pt->vnext;
+        pt->vnext += PAGE_SIZE;
+        add_pte(pt, vnext, added[i], PF_PRESENT | PF_RW, CONTAINS_TABLE);
+    }
+}
+
+/// Map a run of consecutive small pages. If the pages are present, each is
+/// given a zeroed frame; otherwise they're reserved. The table hierarchy is
+/// walked once per PT page, and the rest of the PT page's entries in the
+/// run are filled in a single loop.
+static void
+map_range(pagetable_t *pt, uint64_t vaddr, int count, uint32_t pflags)
+{
+    bool alloc = (pflags & PF_PRESENT) != 0;
+    while (count > 0) {
+        // Map the first page with add_pte, which creates any missing tables,
+        // and then locate its PT entry.
+        add_pte(pt, vaddr, alloc ? pgalloc() : 0, pflags, 0);
+
+        int       order;
+        uint64_t *pte = find_pte(pt, vaddr, &order);
+
+        int n = min(count, 512 - (int)PTE(vaddr));
+        for (int i = 1; i < n; i++) {
+            if (pte[i] != 0)
+                fatal();
+            pte[i] = (alloc ? pgalloc() : 0) | pflags;
+        }
+
+        count -= n;
+        vaddr += (uint64_t)n * PAGE_SIZE;
+    }
 }
 
 void
@@ -368,15 +1690,28 @@ pagetable_create(pagetable_t *pt, void *vaddr, uint64_t size)
 
     // Allocate a page from the top level of the page table hierarchy.
     pt->proot = pgalloc();
+    memacct.table_pages++;
     pt->vroot = (uint64_t)vaddr;
     pt->vnext = (uint64_t)vaddr + PAGE_SIZE;
     pt->vterm = (uint64_t)vaddr + size;
+    pt->pcid  = 0;
+    pt->hand  = 0;
+    pt->rss   = 0;
+    pt->wss   = 0;
 
     // Install the kernel's page table into the created page table.
     page_t *src = (page_t *)kpt.proot;
     page_t *dst = (page_t *)pt->proot;
     for (int i = 0; i < 512; i++)
         dst->entry[i] = src->entry[i];
+
+    // Map the root table page at the start of the table's virtual address
+    // range, so it's freed along with the rest of the table.
+    add_pte(pt, pt->vroot, pt->proot, PF_PRESENT | PF_RW, CONTAINS_TABLE);
+
+    // Add the table to the registry scanned for pages to reclaim.
+    pt->next   = pagetables;
+    pagetables = pt;
 }
 
 void
@@ -385,18 +1720,116 @@ pagetable_destroy(pagetable_t *pt)
     if (pt->proot == 0)
         fatal();
 
-    // Recursively destroy all pages starting from the PML4 table.
+    // Remove the table from the registry, moving the reclaim scanner on to
+    // the next table if it was sweeping this one.
+    for (pagetable_t **p = &pagetables; *p != NULL; p = &(*p)->next) {
+        if (*p == pt) {
+            *p = pt->next;
+            break;
+        }
+    }
+    if (lru.pt == pt) {
+        lru.pt   = pt->next;
+        lru.hand = 0;
+        lru.rss  = 0;
+        lru.wss  = 0;
+    }
+
+    // Recursively destroy all pages starting from the PML4 table, including
+    // the table pages mapped between vroot and vnext.
     pgfree_recurse((page_t *)pt->proot, 4);
+    memacct.table_pages -= (pt->vnext - pt->vroot) / PAGE_SIZE;
 
-    // Invalidate TLB entries of all table pages.
-    if (pt == active_pt) {
-        for (uint64_t vaddr = pt->vroot; vaddr < pt->vterm;
-             vaddr += PAGE_SIZE) {
-            invalidate_page((void *)vaddr);
+    // Every non-kernel mapping is gone, so flush the whole TLB and return
+    // the table's PCID to the pool.
+    tlb_flush_all(pt);
+    if (pcids.owner[pt->pcid] == pt)
+        pcids.owner[pt->pcid] = NULL;
+
+    memzero(pt, sizeof(pagetable_t));
+}
+
+/// Share the leaf pages mapped beneath a source table page with a cloned
+/// page table. Writable pages become read-only copy-on-write pages in both
+/// page tables.
+static void
+clone_recurse(pagetable_t *dst, const pagetable_t *src, page_t *page,
+              int level, uint64_t vbase)
+{
+    int shift = PGSHIFT_PTE + 9 * (level - 1);
+    for (uint64_t e = 0; e < 512; e++) {
+        uint64_t *entry = &page->entry[e];
+        if (*entry == 0)
+            continue;
+
+        // Kernel tables are already shared by every page table. Addresses
+        // in the upper half of the address space must be sign-extended.
+        uint64_t vaddr = vbase | (e << shift);
+        if (level == 4) {
+            if (*entry & PF_SYSTEM)
+                continue;
+            if (e >= 256)
+                vaddr |= 0xffff000000000000;
+        }
+
+        // Traverse child tables until reaching a leaf entry.
+        if (level > 1 && (*entry & PF_PS) == 0) {
+            clone_recurse(dst, src, PGPTR(*entry), level - 1, vaddr);
+            continue;
+        }
+
+        // The clone has its own table pages, so don't share the source's.
+        if (vaddr >= src->vroot && vaddr < src->vterm)
+            continue;
+
+        // Split the entry into its frame address and its flags. Leaf
+        // entries of large and huge pages hold the PAT flag in bit 12, and
+        // any leaf may hold NX in bit 63.
+        uint64_t amask = (level > 1) ? PGMASK_PADDR_LARGE : PGMASK_PADDR;
+        uint64_t paddr = *entry & amask;
+
+        // Swapped out pages share their compressed copy.
+        if ((*entry & (PF_PRESENT | PF_SWAP)) == PF_SWAP) {
+            zswap_dup(PTE_TO_SLOT(*entry));
         }
+        else if (paddr != 0 && PADDR_VALID(paddr) &&
+                 PADDR_TO_PF(paddr)->type == PFTYPE_ALLOCATED) {
+            pf_t *pf = PADDR_TO_PF(paddr);
+            if (*entry & PF_RW) {
+                *entry = (*entry & ~PF_RW) | PF_COW;
+                pf->sharecount++;
+            }
+            if (*entry & PF_COW)
+                pf->sharecount++;
+            pf->refcount++;
+            pgstats.cow_shares++;
+        }
+
+        // Small page entries hold the PAT flag where larger pages hold PS,
+        // which add_pte sets itself.
+        uint64_t pflags   = *entry & ~amask;
+        if (level > 1)
+            pflags &= ~(uint64_t)PF_PS;
+        uint32_t addflags = (level == 3) ? HUGE_PAGE
+                            : (level == 2) ? LARGE_PAGE : 0;
+        add_pte(dst, vaddr, paddr, pflags, addflags);
     }
+}
 
-    memzero(pt, sizeof(pagetable_t));
+void
+pagetable_clone(pagetable_t *dst, pagetable_t *src)
+{
+    if (src->proot == 0)
+        fatal();
+
+    // Create the clone with its table stored at the same virtual address
+    // range as the source's table.
+    pagetable_create(dst, (void *)src->vroot, src->vterm - src->vroot);
+    clone_recurse(dst, src, (page_t *)src->proot, 4, 0);
+
+    // Pages that were writable in the source table are now read-only, so
+    // flush its stale TLB entries.
+    tlb_flush_all(src);
 }
 
 void
@@ -407,25 +1840,563 @@ pagetable_activate(pagetable_t *pt)
     if (pt->proot == 0)
         fatal();
 
-    set_pagetable(pt->proot);
+    set_pagetable(pcid_cr3(pt));
     active_pt = pt;
 }
 
+void
+page_merge_enable(bool enable)
+{
+    // Start from an empty merge table whenever merging is enabled.
+    if (enable && !merge.enabled) {
+        for (int b = 0; b < MERGE_BUCKETS; b++)
+            merge.pfn[b] = PFN_INVALID;
+    }
+    merge.enabled = enable;
+}
+
+bool
+page_merge_enabled()
+{
+    return merge.enabled;
+}
+
+const pagetable_t *
+pagetable_next(const pagetable_t *prev)
+{
+    return (prev == NULL) ? pagetables : prev->next;
+}
+
 void *
 page_alloc(pagetable_t *pt, void *vaddr_in, int count)
 {
-    for (uint64_t vaddr = (uint64_t)vaddr_in; count--; vaddr += PAGE_SIZE) {
-        uint64_t paddr = pgalloc();
-        add_pte(pt, vaddr, paddr, PF_PRESENT | PF_RW, 0);
+    uint64_t start = rdtsc();
+
+    pgstats.eager_pages += count;
+    map_range(pt, (uint64_t)vaddr_in, count, PF_PRESENT | PF_RW);
+
+    pgstats.eager_cycles += rdtsc() - start;
+    return vaddr_in;
+}
+
+void *
+page_reserve(pagetable_t *pt, void *vaddr_in, int count)
+{
+    map_range(pt, (uint64_t)vaddr_in, count, PF_DEMAND | PF_RW);
+    return vaddr_in;
+}
+
+/// Allocate and map pages of 2^order frames each, using PS-bit entries for
+/// large and huge pages.
+static void *
+page_alloc_order(pagetable_t *pt, void *vaddr_in, int count, int order,
+                 uint32_t addflags)
+{
+    uint64_t size = (uint64_t)PAGE_SIZE << order;
+    if ((uint64_t)vaddr_in & (size - 1))
+        fatal();
+
+    for (uint64_t vaddr = (uint64_t)vaddr_in; count--; vaddr += size) {
+        uint64_t paddr = pgalloc_order(order);
+        add_pte(pt, vaddr, paddr, PF_PRESENT | PF_RW, addflags);
     }
     return vaddr_in;
 }
 
+void *
+page_alloc_large(pagetable_t *pt, void *vaddr, int count)
+{
+    return page_alloc_order(pt, vaddr, count, PFORDER_LARGE, LARGE_PAGE);
+}
+
+void *
+page_alloc_huge(pagetable_t *pt, void *vaddr, int count)
+{
+    return page_alloc_order(pt, vaddr, count, PFORDER_HUGE, HUGE_PAGE);
+}
+
 void
 page_free(pagetable_t *pt, void *vaddr_in, int count)
 {
-    for (uint64_t vaddr = (uint64_t)vaddr_in; count--; vaddr += PAGE_SIZE) {
-        uint64_t paddr = remove_pte(pt, vaddr);
+    struct tlbbatch batch;
+    tlb_batch_init(&batch, pt);
+
+    uint64_t vaddr = (uint64_t)vaddr_in;
+    while (count > 0) {
+        int       order;
+        uint64_t *pte = find_pte(pt, vaddr, &order);
+        if (pte == NULL)
+            fatal();
+
+        // A large or huge page must be freed in its entirety.
+        if (order != PFORDER_SMALL) {
+            uint64_t size = (uint64_t)PAGE_SIZE << order;
+            if (count < (1 << order) || (vaddr & (size - 1)))
+                fatal();
+            pgfree_pte(*pte);
+            *pte = 0;
+            tlb_batch_add(&batch, vaddr);
+            count -= 1 << order;
+            vaddr += size;
+            continue;
+        }
+
+        // Clear the rest of the run's entries in the PT page in a single
+        // loop.
+        int n = min(count, 512 - (int)PTE(vaddr));
+        for (int i = 0; i < n; i++) {
+            pgfree_pte(pte[i]);
+            pte[i] = 0;
+            tlb_batch_add(&batch, vaddr + (uint64_t)i * PAGE_SIZE);
+        }
+        count -= n;
+        vaddr += (uint64_t)n * PAGE_SIZE;
+    }
+
+    tlb_batch_commit(&batch);
+}
+
+uint64_t
+page_frame_alloc(int order)
+{
+    if (order < 0 || order > PFORDER_MAX)
+        fatal();
+
+    pf_t *pf = pfalloc_order(order);
+    if (pf == NULL)
+        return 0;
+    memacct.allocs += 1ull << order;
+
+    uint64_t paddr = PF_TO_PADDR(pf);
+    memzero((void *)paddr, (uint64_t)PAGE_SIZE << order);
+    return paddr;
+}
+
+void
+page_frame_free(uint64_t paddr, int order)
+{
+    if (order < 0 || order > PFORDER_MAX)
+        fatal();
+
+    pffree_order(PADDR_TO_PF(paddr), order);
+    memacct.frees += 1ull << order;
+}
+
+/// The kmapupdate tracks the effects of a change to the kernel's direct map.
+struct kmapupdate
+{
+    struct tlbbatch batch;        ///< Pages whose TLB entries are stale
+    bool            retyped;      ///< Whether mapped memory changed type
+};
+
+/// Return the size of the memory mapped by a leaf entry at a table level
+/// (1=PT, 2=PD, 3=PDPT).
+static inline uint64_t
+level_size(int level)
+{
+    return (uint64_t)PAGE_SIZE << ((level - 1) * 9);
+}
+
+/// Return the entry at a table level beneath a kernel table holding the
+/// entry for an address.
+static inline uint64_t *
+level_entry(page_t *table, int level, uint64_t vaddr)
+{
+    int shift = PGSHIFT_PTE + (level - 1) * 9;
+    return &table->entry[(vaddr >> shift) & PGMASK_ENTRY];
+}
+
+/// Return the kernel leaf entry at a level mapping identity-mapped memory of
+/// a type, or 0 if memory of the type isn't mapped.
+static inline uint64_t
+kmap_leaf(int level, uint64_t vaddr, uint32_t type)
+{
+    uint64_t flags = (level == 1) ? kmem_ptflags(type) : kmem_pdflags(type);
+    return flags ? vaddr | flags : 0;
+}
+
+/// Return true if two kernel entries map the same memory the same way. The
+/// accessed and dirty flags the CPU sets on live entries are ignored.
+static inline bool
+kmap_same(uint64_t e1, uint64_t e2)
+{
+    return ((e1 ^ e2) & ~(uint64_t)KMAP_CPU_FLAGS) == 0;
+}
+
+/// Return a kernel table no longer referenced by the direct map to the page
+/// frame database, along with the tables beneath it. The table pages set up
+/// by kmem_init aren't managed by the page frame database, so they're
+/// abandoned.
+static void
+kmap_free_table(uint64_t entry, int level)
+{
+    page_t *table = PGPTR(entry);
+    for (int e = 0; level > 2 && e < 512; e++) {
+        if ((table->entry[e] & PF_PRESENT) && !(table->entry[e] & PF_PS))
+            kmap_free_table(table->entry[e], level - 1);
+    }
+
+    uint64_t paddr = (uint64_t)table;
+    if (PADDR_VALID(paddr) && PADDR_TO_PF(paddr)->type == PFTYPE_ALLOCATED) {
         pgfree(paddr);
+        memacct.table_pages--;
+    }
+}
+
+/// Return the i'th of the 512 leaf entries at the level beneath a large or
+/// huge page's leaf entry that together map the same memory.
+static uint64_t
+split_entry(uint64_t leaf, int level, int i)
+{
+    uint64_t size  = level_size(level - 1);
+    uint64_t flags = leaf & (PGMASK_OFFSET | PF_PAT_LARGE);
+    uint64_t paddr = leaf & ~(level_size(level) - 1);
+
+    // Small page entries hold the PAT flag where larger pages hold PS.
+    if (level == 2) {
+        flags = (flags & ~(PF_PS | PF_PAT_LARGE)) |
+                ((flags & PF_PAT_LARGE) ? PF_PAT : 0);
+    }
+    return (paddr + i * size) | flags;
+}
+
+/// Return the leaf entry at a level that maps the same memory as all the
+/// entries of a table beneath it, or 0 if they can't be merged. Only
+/// identity-mapped memory of a single type is merged.
+static uint64_t
+merge_entry(const page_t *table, int level, uint64_t vaddr)
+{
+    uint64_t size = level_size(level - 1);
+    uint64_t e0   = table->entry[0];
+    if ((e0 & PF_PRESENT) == 0 || (level == 3 && (e0 & PF_PS) == 0))
+        return 0;
+
+    for (int i = 1; i < 512; i++) {
+        if (!kmap_same(table->entry[i], e0 + i * size))
+            return 0;
+    }
+
+    uint64_t mask  = (level == 2) ? PGMASK_OFFSET
+                     : PGMASK_OFFSET | PF_PAT_LARGE;
+    uint64_t flags = e0 & mask & ~(uint64_t)KMAP_CPU_FLAGS;
+    if ((e0 & ~mask) != vaddr)
+        return 0;
+
+    if (level == 2) {
+        flags = (flags & ~PF_PAT) | PF_PS |
+                ((flags & PF_PAT) ? PF_PAT_LARGE : 0);
+    }
+    return vaddr | flags;
+}
+
+/// Return the table beneath a kernel entry at a level, splitting a large
+/// or huge page's leaf entry into a table of smaller pages mapping the same
+/// memory, or adding an empty table if the entry isn't present.
+static page_t *
+kmap_table(uint64_t *entry, int level, uint64_t vaddr,
+           struct kmapupdate *update)
+{
+    if ((*entry & PF_PRESENT) && (*entry & PF_PS) == 0)
+        return PGPTR(*entry);
+
+    uint64_t paddr = pgalloc();
+    page_t  *table = (page_t *)paddr;
+    memacct.table_pages++;
+
+    if (*entry & PF_PRESENT) {
+        for (int i = 0; i < 512; i++)
+            table->entry[i] = split_entry(*entry, level, i);
+        tlb_batch_add(&update->batch, vaddr);
+        pgstats.kmap_splits++;
+    }
+    *entry = paddr | PF_PRESENT | PF_RW | PF_SYSTEM;
+    return table;
+}
+
+/// Point a kernel entry at a level at its identity-mapped memory, using
+/// a leaf entry for memory of the type. A table replaced by the leaf is
+/// freed.
+static void
+kmap_set_leaf(uint64_t *entry, int level, uint64_t vaddr, uint32_t type,
+              struct kmapupdate *update)
+{
+    uint64_t leaf = kmap_leaf(level, vaddr, type);
+    uint64_t old  = *entry;
+    if (kmap_same(old, leaf))
+        return;
+
+    *entry = leaf;
+    if ((old & PF_PRESENT) == 0)
+        return;
+
+    if (level > 1 && (old & PF_PS) == 0) {
+        kmap_free_table(old, level);
+        tlb_batch_add_range(&update->batch, vaddr, level_size(level));
+    }
+    else {
+        tlb_batch_add(&update->batch, vaddr);
+    }
+    update->retyped = true;
+}
+
+/// Replace the kernel table holding the entries for an address at the
+/// level below 'level' with a single leaf entry, if its entries map
+/// contiguous memory of a single type.
+static void
+kmap_merge(uint64_t vaddr, int level, struct kmapupdate *update)
+{
+    page_t   *pml4t = (page_t *)kpt.proot;
+    uint64_t *entry = level_entry(PGPTR(pml4t->entry[PML4E(vaddr)]), 3,
+                                  vaddr);
+    for (int l = 3; l > level; l--) {
+        if ((*entry & PF_PRESENT) == 0 || (*entry & PF_PS))
+            return;
+        entry = level_entry(PGPTR(*entry), l - 1, vaddr);
+    }
+    if ((*entry & PF_PRESENT) == 0 || (*entry & PF_PS))
+        return;
+
+    uint64_t leaf = merge_entry(PGPTR(*entry), level, vaddr);
+    if (leaf == 0)
+        return;
+
+    uint64_t old = *entry;
+    *entry = leaf;
+    kmap_free_table(old, level);
+    tlb_batch_add_range(&update->batch, vaddr, level_size(level));
+    pgstats.kmap_merges++;
+}
+
+bool
+page_set_memtype(uint64_t paddr, uint64_t size, enum pmemtype type)
+{
+    if (type <= PMEMTYPE_USABLE || type == PMEMTYPE_BAD ||
+        type >= PMEMTYPE_COUNT)
+        return false;
+
+    uint64_t addr = paddr & ~PGMASK_OFFSET;
+    uint64_t term = (paddr + size + PGMASK_OFFSET) & ~PGMASK_OFFSET;
+    if (size == 0 || term <= addr)
+        return false;
+
+    // Memory managed by the page frame database can't be retyped.
+    const pmap_t *map = pmap();
+    for (uint64_t r = 0; r < map->count; r++) {
+        const pmapregion_t *region = &map->region[r];
+        if (region->type == PMEMTYPE_USABLE && region->addr < term &&
+            region->addr + region->size > addr)
+            return false;
+    }
+
+    // The range must lie within the kernel's PML4 entries, since they're
+    // shared with every other page table.
+    page_t *pml4t = (page_t *)kpt.proot;
+    for (uint64_t vaddr = addr; vaddr < term;
+         vaddr = (vaddr | ((1ull << PGSHIFT_PML4E) - 1)) + 1) {
+        if ((pml4t->entry[PML4E(vaddr)] & PF_PRESENT) == 0)
+            return false;
+    }
+
+    struct kmapupdate update;
+    tlb_batch_init(&update.batch, &kpt);
+    update.retyped = false;
+
+    // Map each part of the range with the largest page that fits within
+    // it, splitting larger pages only where the range partially covers
+    // them. Pages already mapping their memory with the type are left
+    // intact.
+    for (uint64_t vaddr = addr; vaddr < term; ) {
+        uint64_t *entry = level_entry(PGPTR(pml4t->entry[PML4E(vaddr)]), 3,
+                                      vaddr);
+        int       level = 3;
+        for (;;) {
+            uint64_t esize = level_size(level);
+            uint64_t base  = vaddr & ~(esize - 1);
+            if (base == vaddr && vaddr + esize <= term)
+                break;
+            if (kmap_same(*entry, kmap_leaf(level, base, type)))
+                break;
+
+            page_t *table = kmap_table(entry, level, base, &update);
+            entry = level_entry(table, --level, vaddr);
+        }
+
+        uint64_t base = vaddr & ~(level_size(level) - 1);
+        kmap_set_leaf(entry, level, base, type, &update);
+        vaddr = base + level_size(level);
+    }
+
+    // Merge tables touched by the update back into large pages, and then
+    // into huge pages, where they map contiguous memory of a single type.
+    for (int level = 2; level <= 3; level++) {
+        uint64_t esize = level_size(level);
+        for (uint64_t vaddr = addr & ~(esize - 1); vaddr < term;
+             vaddr += esize)
+            kmap_merge(vaddr, level, &update);
+    }
+
+    // Memory that changed type must leave no lines cached under its old
+    // type.
+    tlb_batch_commit(&update.batch);
+    if (update.retyped)
+        flush_cache();
+
+    pmap_add(addr, term - addr, type);
+    return true;
+}
+
+void *
+ioremap(uint64_t paddr, uint64_t size, enum pmemtype type)
+{
+    if (type != PMEMTYPE_UNCACHED && type != PMEMTYPE_WRITETHROUGH &&
+        type != PMEMTYPE_WRITECOMBINE)
+        return NULL;
+
+    // The kernel identity-maps physical memory, so the range is mapped at
+    // its physical address.
+    if (!page_set_memtype(paddr, size, type))
+        return NULL;
+    return (void *)paddr;
+}
+
+/// Measure the frame allocation and free rates once at least a second has
+/// passed since the last measurement.
+static void
+memacct_sample()
+{
+    uint32_t hz    = timer_frequency();
+    uint64_t ticks = timer_ticks();
+    if (hz == 0 || ticks - memacct.ticks < hz)
+        return;
+
+    uint64_t elapsed = ticks - memacct.ticks;
+    memacct.alloc_rate   = (memacct.allocs - memacct.ticks_allocs) * hz /
+                           elapsed;
+    memacct.free_rate    = (memacct.frees - memacct.ticks_frees) * hz /
+                           elapsed;
+    memacct.ticks        = ticks;
+    memacct.ticks_allocs = memacct.allocs;
+    memacct.ticks_frees  = memacct.frees;
+}
+
+bool
+page_idle()
+{
+    // The scanner paces itself, so it never keeps the CPU from halting.
+    lru_scan();
+    memacct_sample();
+
+    // Initialize one deferred section of the frame db per call.
+    if (init_next_section())
+        return true;
+
+    if (zpool.count == ZPOOL_SIZE)
+        return false;
+
+    // Zero a small batch of frames so the caller can respond to pending
+    // work (such as keyboard input) promptly.
+    for (int i = 0; i < ZPOOL_BATCH && zpool.count < ZPOOL_SIZE; i++) {
+        pf_t *pf = pfalloc_order(0);
+        if (pf == NULL)
+            return false;
+        memzero((void *)PF_TO_PADDR(pf), PAGE_SIZE);
+        zpool.pfn[zpool.count++] = PF_TO_PFN(pf);
+    }
+    return zpool.count < ZPOOL_SIZE;
+}
+
+void
+page_frame_stats(pfstats_t *stats)
+{
+    memzero(stats, sizeof(pfstats_t));
+    stats->total  = pfdb.count;
+    stats->dbsize = pfdb.size;
+    stats->avail    = pfdb.avail;
+    stats->deferred = pfdb.deferred;
+    stats->nodes = numa_nodes();
+    for (int n = 0; n < stats->nodes; n++) {
+        const struct pfnode *node = &pfdb.node[n];
+        stats->node_avail[n] = node->avail;
+        for (int o = 0; o < PFORDER_COUNT; o++)
+            stats->blocks[o] += node->free[o];
+    }
+
+    for (int c = 0; c < MAX_CPUS; c++) {
+        const struct pfcache *cache = &pfcache[c];
+        stats->avail         += cache->count;
+        stats->cached        += cache->count;
+        stats->cache_hits    += cache->hits;
+        stats->cache_refills += cache->refills;
+        stats->cache_drains  += cache->drains;
     }
+
+    stats->avail      += zpool.count;
+    stats->zeroed      = zpool.count;
+    stats->zero_hits   = zpool.hits;
+    stats->zero_misses = zpool.misses;
+}
+
+void
+page_mem_stats(memstats_t *stats)
+{
+    memzero(stats, sizeof(memstats_t));
+
+    // Classify the frames of each region in the memory map. Only usable
+    // regions have frame records, and frames within them may have been
+    // reserved for the kernel's own use.
+    const pmap_t *map = pmap();
+    for (uint64_t r = 0; r < map->count; r++) {
+        const pmapregion_t *region = &map->region[r];
+        if (region->type <= 0 || region->type >= PMEMTYPE_COUNT)
+            continue;
+
+        uint64_t pfn  = (region->addr + PAGE_SIZE - 1) >> PAGE_SHIFT;
+        uint64_t pfnN = (region->addr + region->size) >> PAGE_SHIFT;
+        if (region->type != PMEMTYPE_USABLE) {
+            stats->reserved[region->type] += pfnN - pfn;
+            continue;
+        }
+
+        for (; pfn < pfnN; pfn++) {
+            if (PFN_DEFERRED(pfn)) {
+                stats->free[PMEMTYPE_USABLE]++;
+                continue;
+            }
+            if (!PFN_VALID(pfn)) {
+                stats->reserved[PMEMTYPE_USABLE]++;
+                continue;
+            }
+            switch (PFN_TO_PF(pfn)->type)
+            {
+                case PFTYPE_AVAILABLE:
+                    stats->free[PMEMTYPE_USABLE]++;
+                    break;
+                case PFTYPE_ALLOCATED:
+                    stats->allocated[PMEMTYPE_USABLE]++;
+                    break;
+                default:
+                    stats->reserved[PMEMTYPE_USABLE]++;
+                    break;
+            }
+        }
+    }
+
+    // Frames in the pre-zeroed pool are recorded as allocated, but they're
+    // available for allocation.
+    stats->allocated[PMEMTYPE_USABLE] -= zpool.count;
+    stats->free[PMEMTYPE_USABLE]      += zpool.count;
+
+    stats->table_pages = memacct.table_pages;
+    stats->allocs      = memacct.allocs;
+    stats->frees       = memacct.frees;
+    stats->alloc_rate  = memacct.alloc_rate;
+    stats->free_rate   = memacct.free_rate;
+}
+
+void
+page_stats(pgstats_t *stats)
+{
+    *stats = pgstats;
+    stats->lru_active   = lru.count[LRU_ACTIVE];
+    stats->lru_inactive = lru.count[LRU_INACTIVE];
 }
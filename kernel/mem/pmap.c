@@ -296,8 +296,9 @@ pmap_init()
     // function cleans up the BIOS memory map (sorts it, removes overlaps,
     // etc.) and adds a few additional memory regions.
 
-    // Mark VGA video memory as uncached.
-    add_region(KMEM_VIDEO, KMEM_VIDEO_SIZE, PMEMTYPE_UNCACHED);
+    // Mark VGA video memory as write-combining, so streams of writes to it
+    // are sent in bursts.
+    add_region(KMEM_VIDEO, KMEM_VIDEO_SIZE, PMEMTYPE_WRITECOMBINE);
 
     // Reserve memory for the kernel and its global data structures.
     add_region(0, KMEM_KERNEL_IMAGE_END, PMEMTYPE_RESERVED);
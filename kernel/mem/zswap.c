@@ -0,0 +1,378 @@
+//============================================================================
+/// @file       zswap.c
+/// @brief      Compressed in-memory page store.
+//
+//  Copyright 2016 Brett Vickers.
+//  Use of this source code is governed by a BSD-style license
+//  that can be found in the MonkOS LICENSE file.
+//============================================================================
+
+#include <core.h>
+#include <libc/string.h>
+#include <kernel/mem/paging.h>
+#include <kernel/mem/zswap.h>
+#include <kernel/x86/cpu.h>
+
+// Store constants
+#define ZSWAP_CHUNK        64       // Bytes per allocation chunk
+#define ZSWAP_CHUNKS       (PAGE_SIZE / ZSWAP_CHUNK) // Chunks per frame
+#define ZSWAP_MAX_SIZE     (PAGE_SIZE * 3 / 4) // Largest page stored
+#define ZSWAP_MAX_FRAMES   2048     // Frames holding compressed pages
+#define ZSWAP_MAX_SLOTS    16384    // Pages held in the store
+
+// Compression constants
+#define LZ_MINMATCH        4        // Shortest match encoded
+#define LZ_HASH_BITS       12       // Log2 of match finder table size
+#define LZ_RUN_MAX         15       // Largest length held in a token nibble
+
+STATIC_ASSERT(ZSWAP_CHUNKS == 64, "Chunk bitmap must fit in 64 bits");
+
+/// A zframe is a page frame holding compressed pages in 64-byte chunks.
+/// Released zframe records are linked through their used field.
+struct zframe
+{
+    uint64_t paddr;               ///< Physical address of the frame (0 if
+                                  ///  the record is released)
+    uint64_t used;                ///< Bitmap of chunks in use
+};
+
+/// A zslot records where a compressed page is held. Free slots are linked
+/// through their frame field.
+struct zslot
+{
+    uint16_t frame;               ///< Index of the zframe holding the page
+    uint8_t  chunk;               ///< First chunk holding the page
+    uint8_t  chunks;              ///< Number of chunks holding the page
+    uint16_t size;                ///< Compressed size in bytes
+    uint16_t refcount;            ///< References to the page (0 if free)
+};
+
+/// The store is zero-initialized, so it stays out of the kernel image's
+/// data. Slot 0 is never used, since it means no slot, and released zframe
+/// records are numbered from 1 on their list for the same reason.
+struct zswap
+{
+    uint32_t      frames;                    ///< zframe records in use
+    uint32_t      freeframe;                 ///< Head of released zframes
+    uint32_t      hint;                      ///< zframe last allocated from
+    uint32_t      freeslot;                  ///< Head of free slot list
+    uint32_t      touched;                   ///< Last slot ever used
+    uint32_t      pages;                     ///< Pages held
+    uint64_t      bytes;                     ///< Compressed bytes held
+    uint64_t      stores;                    ///< Pages stored
+    uint64_t      rejects;                   ///< Pages rejected
+    struct zframe frame[ZSWAP_MAX_FRAMES];
+    struct zslot  slot[ZSWAP_MAX_SLOTS];     ///< Indexed by slot number
+};
+
+static struct zswap zswap;
+
+// Compression scratch state
+static uint8_t  lzbuf[PAGE_SIZE];
+static uint16_t lzhash[1 << LZ_HASH_BITS];
+
+static inline uint32_t
+read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/// Append a run length's continuation bytes to the output.
+static int
+lz_putlen(uint8_t *dst, int op, int len)
+{
+    for (len -= LZ_RUN_MAX; len >= 255; len -= 255)
+        dst[op++] = 255;
+    dst[op++] = (uint8_t)len;
+    return op;
+}
+
+/// Append a sequence of literals followed by a match (if mlen is non-zero).
+/// Return the new output size, or -1 if the output would exceed dstmax.
+static int
+lz_emit(uint8_t *dst, int op, int dstmax, const uint8_t *lit, int litlen,
+        int offset, int mlen)
+{
+    int ml = mlen ? mlen - LZ_MINMATCH : 0;
+    if (op + 1 + litlen + litlen / 255 + 1 + 2 + ml / 255 + 1 > dstmax)
+        return -1;
+
+    uint8_t *token = dst + op++;
+    *token = (uint8_t)((min(litlen, LZ_RUN_MAX) << 4) | min(ml, LZ_RUN_MAX));
+
+    if (litlen >= LZ_RUN_MAX)
+        op = lz_putlen(dst, op, litlen);
+    memcpy(dst + op, lit, litlen);
+    op += litlen;
+
+    if (mlen) {
+        dst[op++] = (uint8_t)offset;
+        dst[op++] = (uint8_t)(offset >> 8);
+        if (ml >= LZ_RUN_MAX)
+            op = lz_putlen(dst, op, ml);
+    }
+    return op;
+}
+
+/// Compress a page into a sequence of (literal run, back-reference) pairs.
+/// Return the compressed size, or 0 if it would exceed dstmax.
+static int
+lz_compress(const uint8_t *src, uint8_t *dst, int dstmax)
+{
+    memzero(lzhash, sizeof(lzhash));
+
+    int ip = 0, anchor = 0, op = 0;
+    while (ip + LZ_MINMATCH <= PAGE_SIZE) {
+        // Look up the last position holding the same 4 bytes. Positions
+        // are stored biased by one so that 0 means none.
+        uint32_t seq = read32(src + ip);
+        uint32_t h   = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+        int      ref = (int)lzhash[h] - 1;
+        lzhash[h] = (uint16_t)(ip + 1);
+        if (ref < 0 || read32(src + ref) != seq) {
+            ip++;
+            continue;
+        }
+
+        int len = LZ_MINMATCH;
+        while (ip + len < PAGE_SIZE && src[ref + len] == src[ip + len])
+            len++;
+
+        op = lz_emit(dst, op, dstmax, src + anchor, ip - anchor, ip - ref,
+                     len);
+        if (op < 0)
+            return 0;
+        ip    += len;
+        anchor = ip;
+    }
+
+    // Finish with the remaining literals, if any.
+    if (anchor < PAGE_SIZE) {
+        op = lz_emit(dst, op, dstmax, src + anchor, PAGE_SIZE - anchor, 0, 0);
+        if (op < 0)
+            return 0;
+    }
+    return op;
+}
+
+/// Read a run length's continuation bytes from the input.
+static int
+lz_getlen(const uint8_t *src, int *ip, int len)
+{
+    if (len == LZ_RUN_MAX) {
+        uint8_t b;
+        do {
+            b    = src[(*ip)++];
+            len += b;
+        } while (b == 255);
+    }
+    return len;
+}
+
+static void
+lz_decompress(const uint8_t *src, uint8_t *dst)
+{
+    int ip = 0, op = 0;
+    while (op < PAGE_SIZE) {
+        uint8_t token  = src[ip++];
+        int     litlen = lz_getlen(src, &ip, token >> 4);
+        if (op + litlen > PAGE_SIZE)
+            fatal();
+        memcpy(dst + op, src + ip, litlen);
+        ip += litlen;
+        op += litlen;
+        if (op == PAGE_SIZE)
+            break;
+
+        int offset = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+        int mlen = lz_getlen(src, &ip, token & LZ_RUN_MAX) + LZ_MINMATCH;
+        if (offset == 0 || offset > op || op + mlen > PAGE_SIZE)
+            fatal();
+
+        // Copy a byte at a time, since the match may overlap its output.
+        for (const uint8_t *ref = dst + op - offset; mlen--; )
+            dst[op++] = *ref++;
+    }
+}
+
+/// Return a bitmap of the chunks that start a free run of 'chunks' chunks
+/// in a frame whose used chunks are 'used'.
+static inline uint64_t
+chunks_fit(uint64_t used, int chunks)
+{
+    // Each step doubles the length of the runs the bitmap represents.
+    uint64_t fit = ~used;
+    int      len = 1;
+    while (fit != 0 && len < chunks) {
+        int step = min(len, chunks - len);
+        fit &= fit >> step;
+        len += step;
+    }
+    return fit;
+}
+
+/// Find room for a run of chunks, adding a frame to the store if needed.
+/// Return false if there is no room. The search starts with the frame last
+/// allocated from, which usually still has room.
+static bool
+chunks_alloc(int chunks, uint16_t *frame, uint8_t *chunk)
+{
+    uint64_t mask = (chunks == ZSWAP_CHUNKS) ? (uint64_t)-1
+                    : (1ull << chunks) - 1;
+
+    for (uint32_t i = 0; i < zswap.frames; i++) {
+        uint32_t       f  = (zswap.hint + i) % zswap.frames;
+        struct zframe *zf = &zswap.frame[f];
+        if (zf->paddr == 0)
+            continue;
+        uint64_t fit = chunks_fit(zf->used, chunks);
+        if (fit != 0) {
+            int c = __builtin_ctzll(fit);
+            zf->used  |= mask << c;
+            zswap.hint = f;
+            *frame     = (uint16_t)f;
+            *chunk     = (uint8_t)c;
+            return true;
+        }
+    }
+
+    // Reuse a released zframe record, or add a new one.
+    if (zswap.freeframe == 0 && zswap.frames == ZSWAP_MAX_FRAMES)
+        return false;
+
+    uint64_t paddr = page_frame_alloc(PFORDER_SMALL);
+    if (paddr == 0)
+        return false;
+
+    uint32_t f;
+    if (zswap.freeframe != 0) {
+        f               = zswap.freeframe - 1;
+        zswap.freeframe = (uint32_t)zswap.frame[f].used;
+    }
+    else {
+        f = zswap.frames++;
+    }
+
+    zswap.frame[f].paddr = paddr;
+    zswap.frame[f].used  = mask;
+    zswap.hint           = f;
+    *frame = (uint16_t)f;
+    *chunk = 0;
+    return true;
+}
+
+static void
+chunks_free(uint16_t frame, uint8_t chunk, int chunks)
+{
+    uint64_t mask = (chunks == ZSWAP_CHUNKS) ? (uint64_t)-1
+                    : (1ull << chunks) - 1;
+
+    // Return the frame once it holds nothing.
+    struct zframe *zf = &zswap.frame[frame];
+    zf->used &= ~(mask << chunk);
+    if (zf->used == 0) {
+        page_frame_free(zf->paddr, PFORDER_SMALL);
+        zf->paddr       = 0;
+        zf->used        = zswap.freeframe;
+        zswap.freeframe = frame + 1;
+    }
+}
+
+uint32_t
+zswap_store(const void *page)
+{
+    // Find a slot for the page.
+    uint32_t s = zswap.freeslot;
+    if (s == 0 && zswap.touched == ZSWAP_MAX_SLOTS - 1)
+        goto reject;
+
+    // Compress the page, rejecting it if it doesn't shrink enough.
+    int size = lz_compress((const uint8_t *)page, lzbuf, ZSWAP_MAX_SIZE);
+    if (size == 0)
+        goto reject;
+
+    int      chunks = (size + ZSWAP_CHUNK - 1) / ZSWAP_CHUNK;
+    uint16_t frame;
+    uint8_t  chunk;
+    if (!chunks_alloc(chunks, &frame, &chunk))
+        goto reject;
+
+    if (s != 0)
+        zswap.freeslot = zswap.slot[s].frame;
+    else
+        s = ++zswap.touched;
+
+    struct zslot *zs = &zswap.slot[s];
+    zs->frame    = frame;
+    zs->chunk    = chunk;
+    zs->chunks   = (uint8_t)chunks;
+    zs->size     = (uint16_t)size;
+    zs->refcount = 1;
+
+    void *dst = (void *)(zswap.frame[frame].paddr + chunk * ZSWAP_CHUNK);
+    memcpy(dst, lzbuf, size);
+
+    zswap.pages++;
+    zswap.bytes += size;
+    zswap.stores++;
+    return s;
+
+reject:
+    zswap.rejects++;
+    return 0;
+}
+
+void
+zswap_load(uint32_t slot, void *page)
+{
+    const struct zslot *zs = &zswap.slot[slot];
+    if (slot == 0 || slot > zswap.touched || zs->refcount == 0)
+        fatal();
+
+    const void *src =
+        (const void *)(zswap.frame[zs->frame].paddr + zs->chunk * ZSWAP_CHUNK);
+    lz_decompress((const uint8_t *)src, (uint8_t *)page);
+}
+
+void
+zswap_dup(uint32_t slot)
+{
+    struct zslot *zs = &zswap.slot[slot];
+    if (slot == 0 || slot > zswap.touched || zs->refcount == 0)
+        fatal();
+    zs->refcount++;
+}
+
+void
+zswap_free(uint32_t slot)
+{
+    struct zslot *zs = &zswap.slot[slot];
+    if (slot == 0 || slot > zswap.touched || zs->refcount == 0)
+        fatal();
+    if (--zs->refcount > 0)
+        return;
+
+    chunks_free(zs->frame, zs->chunk, zs->chunks);
+    zswap.pages--;
+    zswap.bytes -= zs->size;
+
+    zs->frame      = (uint16_t)zswap.freeslot;
+    zswap.freeslot = slot;
+}
+
+void
+zswap_stats(zswapstats_t *stats)
+{
+    stats->pages   = zswap.pages;
+    stats->frames  = 0;
+    stats->bytes   = zswap.bytes;
+    stats->stores  = zswap.stores;
+    stats->rejects = zswap.rejects;
+    for (uint32_t f = 0; f < zswap.frames; f++) {
+        if (zswap.frame[f].paddr != 0)
+            stats->frames++;
+    }
+}
@@ -16,7 +16,10 @@
 #include <kernel/device/keyboard.h>
 #include <kernel/mem/acpi.h>
 #include <kernel/mem/heap.h>
+#include <kernel/mem/kmalloc.h>
 #include <kernel/mem/paging.h>
+#include <kernel/mem/pmap.h>
+#include <kernel/mem/zswap.h>
 #include <kernel/x86/cpu.h>
 
 #define TTY_CONSOLE  0
@@ -29,8 +32,17 @@ static bool cmd_display_help();
 static bool cmd_display_apic();
 static bool cmd_display_pci();
 static bool cmd_display_pcie();
+static bool cmd_display_pfdb();
+static bool cmd_display_mem();
+static bool cmd_display_wss();
+static bool cmd_toggle_merge();
+static bool cmd_bench_paging();
+static bool cmd_bench_kmalloc();
+static bool cmd_test_swap();
+static bool cmd_test_memtype();
+static bool cmd_test_heap_release();
 static bool cmd_switch_to_keycodes();
-static bool cmd_test_heap();
+static bool cmd_display_heap();
 
 /// Shell mode descriptor.
 typedef struct mode
@@ -86,7 +98,16 @@ static struct cmd commands[] =
     { "pci", "Show PCI devices", cmd_display_pci },
     { "pcie", "Show PCIexpress configuration", cmd_display_pcie },
     { "kc", "Switch to keycode display mode", cmd_switch_to_keycodes },
-    { "heap", "Test heap allocation", cmd_test_heap },
+    { "pf", "Show page frame allocator state", cmd_display_pfdb },
+    { "mem", "Show memory accounting", cmd_display_mem },
+    { "ws", "Show page table working sets", cmd_display_wss },
+    { "merge", "Toggle same-page merging", cmd_toggle_merge },
+    { "pgbench", "Benchmark page mapping", cmd_bench_paging },
+    { "kbench", "Benchmark kernel allocator", cmd_bench_kmalloc },
+    { "swap", "Test compressed swap", cmd_test_swap },
+    { "memtype", "Test retyping of kernel memory", cmd_test_memtype },
+    { "heaprel", "Test releasing heap pages", cmd_test_heap_release },
+    { "heap", "Show heap layout and check heaps", cmd_display_heap },
 };
 
 static int
@@ -173,32 +194,448 @@ cmd_display_pcie()
 }
 
 static bool
-cmd_switch_to_keycodes()
+cmd_display_pfdb()
 {
+    pfstats_t stats;
+    page_frame_stats(&stats);
+
+    tty_printf(TTY_CONSOLE,
+               "Frames: %u total, %u available, %u deferred (db %luKiB)\n",
+               stats.total, stats.avail, stats.deferred, stats.dbsize >> 10);
+
+    for (int o = 0; o < PFORDER_COUNT; o++) {
+        uint64_t kib = 4ull << o;
+        if (kib < 1024)
+            tty_printf(TTY_CONSOLE, "  order %-2d %4luK: %u\n", o, kib,
+                       stats.blocks[o]);
+        else
+            tty_printf(TTY_CONSOLE, "  order %-2d %4luM: %u\n", o,
+                       kib / 1024, stats.blocks[o]);
+    }
+
+    for (int n = 0; stats.nodes > 1 && n < stats.nodes; n++) {
+        tty_printf(TTY_CONSOLE, "Node %d: %u frames available\n", n,
+                   stats.node_avail[n]);
+    }
+
+    tty_printf(TTY_CONSOLE,
+               "CPU caches: %u frames, %lu hits, %lu refills, %lu drains\n",
+               stats.cached, stats.cache_hits, stats.cache_refills,
+               stats.cache_drains);
+
+    uint64_t allocs = stats.zero_hits + stats.zero_misses;
+    tty_printf(TTY_CONSOLE,
+               "Zero pool: %u frames, %lu hits, %lu misses (%lu%% hit rate)\n",
+               stats.zeroed, stats.zero_hits, stats.zero_misses,
+               allocs ? stats.zero_hits * 100 / allocs : 0);
+
+    pgstats_t pgstats;
+    page_stats(&pgstats);
+
+    uint64_t faults = pgstats.demand_faults;
+    uint64_t pages  = pgstats.eager_pages;
+    tty_printf(TTY_CONSOLE,
+               "Demand faults: %lu (%lu cycles avg, %lu max)\n",
+               faults, faults ? pgstats.demand_cycles / faults : 0,
+               pgstats.demand_max_cycles);
+    tty_printf(TTY_CONSOLE,
+               "Eager pages: %lu (%lu cycles avg)\n",
+               pages, pages ? pgstats.eager_cycles / pages : 0);
+    tty_printf(TTY_CONSOLE,
+               "Copy-on-write: %lu shared, %lu copied, %lu reused\n",
+               pgstats.cow_shares, pgstats.cow_copies, pgstats.cow_reuses);
+    tty_printf(TTY_CONSOLE, "TLB flushes: %lu single-page, %lu full\n",
+               pgstats.tlb_page_flushes, pgstats.tlb_full_flushes);
+    tty_printf(TTY_CONSOLE, "Page table switches: %lu warm, %lu cold\n",
+               pgstats.pcid_hits, pgstats.pcid_misses);
+    tty_printf(TTY_CONSOLE, "Kernel map: %lu pages split, %lu merged\n",
+               pgstats.kmap_splits, pgstats.kmap_merges);
+    tty_printf(TTY_CONSOLE, "Zero page: %lu read faults\n",
+               pgstats.zero_faults);
+
+    zswapstats_t zstats;
+    zswap_stats(&zstats);
+    tty_printf(TTY_CONSOLE, "Swap: %lu out, %lu in, %lu rejected\n",
+               pgstats.swap_outs, pgstats.swap_ins, zstats.rejects);
+    tty_printf(TTY_CONSOLE,
+               "Swap store: %u pages in %u frames (%luK compressed)\n",
+               zstats.pages, zstats.frames, zstats.bytes >> 10);
+    return true;
+}
+
+static bool
+cmd_display_mem()
+{
+    static const char *types[PMEMTYPE_COUNT] =
+    {
+        NULL, "Usable", "Reserved", "ACPI", "ACPI NVS", "Bad", "Uncached",
+        "Unmapped", "Write-thru", "Write-comb",
+    };
+
+    memstats_t stats;
+    page_mem_stats(&stats);
+
     tty_print(TTY_CONSOLE,
-              "Entering keycode mode. Hit Alt-Tab to exit.\n");
-    switch_mode(&mode_keycode);
-    return false;
+              "Memory type        Free   Allocated    Reserved\n");
+    for (int t = 1; t < PMEMTYPE_COUNT; t++) {
+        if (stats.free[t] + stats.allocated[t] + stats.reserved[t] == 0)
+            continue;
+        tty_printf(TTY_CONSOLE, "%-10s  %9luK  %9luK  %9luK\n", types[t],
+                   stats.free[t] * 4, stats.allocated[t] * 4,
+                   stats.reserved[t] * 4);
+    }
+
+    tty_printf(TTY_CONSOLE, "Page tables: %lu pages (%luK)\n",
+               stats.table_pages, stats.table_pages * 4);
+
+    const heap_t *heap = NULL;
+    while ((heap = heap_next(heap)) != NULL) {
+        heapstats_t hs;
+        heap_stats(heap, &hs);
+        tty_printf(TTY_CONSOLE,
+                   "Heap %#lx: %lu of %lu pages, %luK used, %luK free, "
+                   "%lu pages returned\n",
+                   (uint64_t)hs.vaddr, hs.pages, hs.maxpages,
+                   hs.used_bytes >> 10, hs.free_bytes >> 10,
+                   hs.trimmed + hs.released);
+    }
+
+    kmallocstats_t ks;
+    kmalloc_stats(&ks);
+    tty_printf(TTY_CONSOLE,
+               "kmalloc: %u of %u slab pages, %lu allocs (%lu from arenas), "
+               "%lu frees\n", ks.slab_pages_used, ks.slab_pages, ks.allocs,
+               ks.heap_allocs, ks.frees);
+    for (int c = 0; c < KMALLOC_CLASSES; c++) {
+        if (ks.slabs[c] == 0)
+            continue;
+        tty_printf(TTY_CONSOLE, "  %4u-byte slabs: %u (%lu objects)\n",
+                   KMALLOC_MIN_SIZE << c, ks.slabs[c], ks.objects[c]);
+    }
+
+    tty_printf(TTY_CONSOLE,
+               "Frames: %lu allocated (%lu/s), %lu freed (%lu/s)\n",
+               stats.allocs, stats.alloc_rate, stats.frees, stats.free_rate);
+    return true;
 }
 
 static bool
-cmd_test_heap()
+cmd_display_wss()
 {
+    tty_print(TTY_CONSOLE, "Page table          PCID  Resident  Working set\n");
+
+    const pagetable_t *pt = NULL;
+    while ((pt = pagetable_next(pt)) != NULL) {
+        tty_printf(TTY_CONSOLE, "%#-18lx  %4lu  %7uK  %10uK\n",
+                   pt->proot, pt->pcid, pt->rss * 4, pt->wss * 4);
+    }
+
+    pgstats_t pgstats;
+    page_stats(&pgstats);
+    tty_printf(TTY_CONSOLE, "LRU: %u active, %u inactive frames\n",
+               pgstats.lru_active, pgstats.lru_inactive);
+    tty_printf(TTY_CONSOLE,
+               "Scanner: %lu pages aged in %lu sweeps "
+               "(%lu activated, %lu deactivated)\n",
+               pgstats.lru_scans, pgstats.lru_sweeps,
+               pgstats.lru_activations, pgstats.lru_deactivations);
+    return true;
+}
+
+static bool
+cmd_toggle_merge()
+{
+    page_merge_enable(!page_merge_enabled());
+
+    pgstats_t pgstats;
+    page_stats(&pgstats);
+    tty_printf(TTY_CONSOLE,
+               "Same-page merging %s: %lu pages hashed, %lu frames freed\n",
+               page_merge_enabled() ? "enabled" : "disabled",
+               pgstats.merge_hashes, pgstats.merge_pages);
+    return true;
+}
+
+static bool
+cmd_bench_paging()
+{
+    // Map and unmap 1GiB of 4KiB pages, first one page per call and then as
+    // a single range. Pages are only reserved, so the results measure the
+    // cost of updating the page table rather than of allocating frames.
+    const int pages = PAGE_SIZE_HUGE / PAGE_SIZE;
+    void     *vaddr = (void *)0x9000000000;
+
     pagetable_t pt;
     pagetable_create(&pt, (void *)0x8000000000, PAGE_SIZE * 1024);
+
+    uint64_t t0 = rdtsc();
+    for (int i = 0; i < pages; i++)
+        page_reserve(&pt, ptr_add(void, vaddr, i * PAGE_SIZE), 1);
+    uint64_t t1 = rdtsc();
+    for (int i = 0; i < pages; i++)
+        page_free(&pt, ptr_add(void, vaddr, i * PAGE_SIZE), 1);
+    uint64_t t2 = rdtsc();
+    page_reserve(&pt, vaddr, pages);
+    uint64_t t3 = rdtsc();
+    page_free(&pt, vaddr, pages);
+    uint64_t t4 = rdtsc();
+
+    pagetable_destroy(&pt);
+
+    tty_printf(TTY_CONSOLE, "Per page: map %lu, unmap %lu cycles/page\n",
+               (t1 - t0) / pages, (t2 - t1) / pages);
+    tty_printf(TTY_CONSOLE, "Range:    map %lu, unmap %lu cycles/page\n",
+               (t3 - t2) / pages, (t4 - t3) / pages);
+    return true;
+}
+
+static bool
+cmd_bench_kmalloc()
+{
+    // Each CPU running the benchmark allocates from its own arena, so the
+    // per-allocation costs should stay flat as CPUs are added. Only the
+    // bootstrap processor runs kernel code for now, so this measures the
+    // single-CPU end of that curve.
+    static void *ptr[512];
+    const int    count = arrsize(ptr);
+    const int    pairs = 100000;
+
+    uint64_t t0 = rdtsc();
+    for (int i = 0; i < count; i++)
+        ptr[i] = kmalloc(64);
+    uint64_t t1 = rdtsc();
+    for (int i = 0; i < count; i++)
+        kfree(ptr[i]);
+    uint64_t t2 = rdtsc();
+    for (int i = 0; i < count; i++)
+        ptr[i] = kmalloc(PAGE_SIZE);
+    uint64_t t3 = rdtsc();
+    for (int i = 0; i < count; i++)
+        kfree(ptr[i]);
+    uint64_t t4 = rdtsc();
+    for (int i = 0; i < pairs; i++)
+        kfree(kmalloc(64));
+    uint64_t t5 = rdtsc();
+    for (int i = 0; i < pairs; i++)
+        kfree(kmalloc(PAGE_SIZE));
+    uint64_t t6 = rdtsc();
+
+    tty_printf(TTY_CONSOLE,
+               "Slab 64B:   alloc %lu, free %lu, pair %lu cycles\n",
+               (t1 - t0) / count, (t2 - t1) / count, (t5 - t4) / pairs);
+    tty_printf(TTY_CONSOLE,
+               "Arena 4KiB: alloc %lu, free %lu, pair %lu cycles\n",
+               (t3 - t2) / count, (t4 - t3) / count, (t6 - t5) / pairs);
+
+    kmallocstats_t ks;
+    kmalloc_stats(&ks);
+    tty_print(TTY_CONSOLE,
+              "CPU  Pages    Used    Allocs     Frees    Remote  Drains\n");
+    for (int c = 0; c < MAX_CPUS; c++) {
+        const kmallocarenastats_t *as = &ks.arena[c];
+        if (as->pages == 0)
+            continue;
+        tty_printf(TTY_CONSOLE, "%3d  %5lu  %5luK  %8lu  %8lu  %8lu  %6lu\n",
+                   c, as->pages, as->used_bytes >> 10, as->allocs, as->frees,
+                   as->remote_frees, as->drains);
+    }
+    return true;
+}
+
+static bool
+cmd_test_swap()
+{
+    // Touch more pages than there are free frames, so that some of them
+    // must be swapped out, and then check that every page kept its
+    // contents.
+    pfstats_t stats;
+    page_frame_stats(&stats);
+    int pages = (int)stats.avail + 4096;
+
+    pagetable_t pt;
+    pagetable_create(&pt, (void *)0x8000000000,
+                     PAGE_SIZE * (pages / 512 + 16));
+    pagetable_activate(&pt);
+
+    uint32_t *mem = (uint32_t *)page_reserve(&pt, (void *)0x9000000000,
+                                             pages);
+    for (int i = 0; i < pages; i++)
+        mem[i * (PAGE_SIZE / sizeof(uint32_t))] = (uint32_t)i;
+
+    int errors = 0;
+    for (int i = 0; i < pages; i++) {
+        if (mem[i * (PAGE_SIZE / sizeof(uint32_t))] != (uint32_t)i)
+            errors++;
+    }
+
+    page_free(&pt, mem, pages);
+    pagetable_activate(NULL);
+    pagetable_destroy(&pt);
+
+    tty_printf(TTY_CONSOLE, "Touched %d pages, %d errors\n", pages, errors);
+    return true;
+}
+
+static bool
+cmd_test_memtype()
+{
+    // Find a large page of reserved memory. The kernel maps it with a
+    // large (or huge) page, since the frame db doesn't manage it.
+    const pmap_t *map  = pmap();
+    uint64_t      addr = 0;
+    enum pmemtype type = PMEMTYPE_RESERVED;
+    for (uint64_t r = 0; r < map->count && addr == 0; r++) {
+        const pmapregion_t *region = &map->region[r];
+        if (region->type != PMEMTYPE_RESERVED &&
+            region->type != PMEMTYPE_ACPI &&
+            region->type != PMEMTYPE_ACPI_NVS)
+            continue;
+
+        uint64_t base = (region->addr + PAGE_SIZE_LARGE - 1) &
+                        ~(uint64_t)(PAGE_SIZE_LARGE - 1);
+        if (base != 0 &&
+            base + PAGE_SIZE_LARGE <= region->addr + region->size) {
+            addr = base;
+            type = (enum pmemtype)region->type;
+        }
+    }
+    if (addr == 0) {
+        tty_print(TTY_CONSOLE,
+                  "No large page of reserved memory to retype\n");
+        return true;
+    }
+
+    // Read the memory so that the CPU marks its page accessed, and then
+    // retype all of it and a small page within it to the type it already
+    // has. Neither should split the page.
+    (void)*(volatile const uint8_t *)addr;
+
+    pgstats_t before, after;
+    page_stats(&before);
+    page_set_memtype(addr, PAGE_SIZE_LARGE, type);
+    page_set_memtype(addr + PAGE_SIZE, PAGE_SIZE, type);
+    page_stats(&after);
+
+    uint64_t splits = after.kmap_splits - before.kmap_splits;
+    tty_printf(TTY_CONSOLE, "Retyped %#lx: %lu splits, %lu merges (%s)\n",
+               addr, splits, after.kmap_merges - before.kmap_merges,
+               splits == 0 ? "ok" : "FAILED");
+    return true;
+}
+
+static bool
+cmd_test_heap_release()
+{
+    // Release the pages of a free block, and then free the blocks on
+    // either side of it. The merged block must stay released, so a second
+    // release finds nothing left to release.
+    pagetable_t pt;
+    pagetable_create(&pt, (void *)0x8000000000, PAGE_SIZE * 16);
     pagetable_activate(&pt);
 
-    struct heap *heap = heap_create(&pt, (void *)0x9000000000, 1024);
-    void        *ptr1 = heap_alloc(heap, 128);
-    void        *ptr2 = heap_alloc(heap, 0xff00);
-    void        *ptr3 = heap_alloc(heap, 8);
-    heap_free(heap, ptr1);
-    heap_free(heap, ptr2);
-    heap_free(heap, ptr3);
+    heap_t  *heap = heap_create(&pt, (void *)0x9000000000, 256);
+    uint8_t *a    = (uint8_t *)heap_alloc(heap, 3 * PAGE_SIZE);
+    uint8_t *b    = (uint8_t *)heap_alloc(heap, 5 * PAGE_SIZE);
+    uint8_t *c    = (uint8_t *)heap_alloc(heap, 3 * PAGE_SIZE);
+    memset(a, 0xaa, 3 * PAGE_SIZE);
+    memset(b, 0xbb, 5 * PAGE_SIZE);
+    memset(c, 0xcc, 3 * PAGE_SIZE);
+
+    heap_free(heap, b);
+    uint64_t first = heap_release_unused(heap);
+    heap_free(heap, a);
+
+    // Releasing the pages of the merged block must leave its neighbor
+    // untouched.
+    int errors = 0;
+    for (int i = 0; i < 3 * PAGE_SIZE; i++) {
+        if (c[i] != 0xcc)
+            errors++;
+    }
+    heap_free(heap, c);
+    uint64_t again = heap_release_unused(heap);
+
+    // Split a small block from the released block, and then grow the heap
+    // past the released block at its end. The free blocks left behind must
+    // stay released too.
+    void *d = heap_alloc(heap, 64);
+    again += heap_release_unused(heap);
+    void *e = heap_alloc(heap, 64 * PAGE_SIZE);
+    if (d == NULL || e == NULL)
+        errors++;
+    heap_free(heap, e);
+    again += heap_release_unused(heap);
+    heap_free(heap, d);
+
+    heapstats_t hs;
+    heap_stats(heap, &hs);
+    if (again != 0 || heap_check(heap) != NULL)
+        errors++;
 
     heap_destroy(heap);
     pagetable_activate(NULL);
     pagetable_destroy(&pt);
+
+    tty_printf(TTY_CONSOLE,
+               "Released %lu pages, %lu while merging, %lu again, "
+               "%d errors\n",
+               first, hs.released - first, again, errors);
+    return true;
+}
+
+static bool
+cmd_switch_to_keycodes()
+{
+    tty_print(TTY_CONSOLE,
+              "Entering keycode mode. Hit Alt-Tab to exit.\n");
+    switch_mode(&mode_keycode);
+    return false;
+}
+
+static bool
+cmd_display_heap()
+{
+    const heap_t *heap = NULL;
+    while ((heap = heap_next(heap)) != NULL) {
+        heapstats_t hs;
+        heap_stats(heap, &hs);
+
+        tty_printf(TTY_CONSOLE,
+                   "Heap %#lx: %lu of %lu pages mapped, %lu holding "
+                   "allocations\n",
+                   (uint64_t)hs.vaddr, hs.pages, hs.maxpages, hs.used_pages);
+        tty_printf(TTY_CONSOLE,
+                   "  Used %lu blocks (%lu bytes), free %lu blocks "
+                   "(%lu bytes), tags %lu bytes\n",
+                   hs.used_blocks, hs.used_bytes, hs.free_blocks,
+                   hs.free_bytes, hs.overhead);
+
+        // Fragmentation is the share of free memory outside the largest
+        // free block.
+        uint64_t frag = (hs.free_bytes == 0) ? 0
+                        : 100 - hs.largest_free * 100 / hs.free_bytes;
+        tty_printf(TTY_CONSOLE,
+                   "  Largest free block %lu bytes, %lu%% fragmented\n",
+                   hs.largest_free, frag);
+
+        tty_print(TTY_CONSOLE, "  Free blocks:");
+        for (int b = 0; b < HEAP_HIST_BUCKETS; b++) {
+            if (hs.free_hist[b] == 0)
+                continue;
+            tty_printf(TTY_CONSOLE, " %lu+:%lu",
+                       1ul << (b + HEAP_HIST_SHIFT), hs.free_hist[b]);
+        }
+        tty_print(TTY_CONSOLE, "\n");
+
+        const void *bad = heap_check(heap);
+        if (bad == NULL)
+            tty_print(TTY_CONSOLE, "  Consistent\n");
+        else if (bad == heap)
+            tty_print(TTY_CONSOLE, "  Corrupt free lists\n");
+        else
+            tty_printf(TTY_CONSOLE, "  Corrupt block at %#lx\n",
+                       (uint64_t)bad);
+    }
     return true;
 }
 
@@ -230,7 +667,8 @@ command_run()
     int  cmdlen = 0;
 
     for (;;) {
-        halt();
+        if (!page_idle())
+            halt();
 
         key_t key;
         bool  avail;
@@ -279,7 +717,8 @@ static void
 keycode_run()
 {
     for (;;) {
-        halt();
+        if (!page_idle())
+            halt();
 
         key_t key;
         bool  avail;
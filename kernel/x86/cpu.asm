@@ -25,6 +25,15 @@ section .text
     global io_outd
     global set_pagetable
     global invalidate_page
+    global invalidate_pcid
+    global flush_cache
+    global get_cr0
+    global set_cr0
+    global get_cr4
+    global set_cr4
+    global rdtsc
+    global get_pagefault_addr
+    global cpu_index
     global enable_interrupts
     global disable_interrupts
     global halt
@@ -42,6 +51,7 @@ cpuid:
     push    rbx
 
     mov     rax,    rdi
+    xor     ecx,    ecx
     cpuid
 
     mov     [rsi + 8 * 0],  rax
@@ -185,6 +195,105 @@ invalidate_page:
     invlpg  [rdi]
     ret
 
+;-----------------------------------------------------------------------------
+; @function     invalidate_pcid
+; @brief        Invalidate TLB entries tagged with a process-context
+;               identifier.
+; @reg[in]      rdi     The INVPCID invalidation type.
+; @reg[in]      rsi     The PCID whose entries should be invalidated.
+; @reg[in]      rdx     The virtual address to invalidate, for
+;                       INVPCID_ADDRESS invalidations.
+;-----------------------------------------------------------------------------
+invalidate_pcid:
+
+    push    rdx
+    push    rsi
+    invpcid rdi,    [rsp]
+    add     rsp,    16
+    ret
+
+;-----------------------------------------------------------------------------
+; @function     flush_cache
+; @brief        Write back and invalidate the contents of all CPU caches.
+;-----------------------------------------------------------------------------
+flush_cache:
+
+    wbinvd
+    ret
+
+;-----------------------------------------------------------------------------
+; @function     get_cr0
+; @brief        Return the contents of the CR0 control register.
+; @reg[out]     rax     The contents of CR0.
+;-----------------------------------------------------------------------------
+get_cr0:
+
+    mov     rax,    cr0
+    ret
+
+;-----------------------------------------------------------------------------
+; @function     set_cr0
+; @brief        Update the CR0 control register.
+; @reg[in]      rdi     The new contents of CR0.
+;-----------------------------------------------------------------------------
+set_cr0:
+
+    mov     cr0,    rdi
+    ret
+
+;-----------------------------------------------------------------------------
+; @function     get_cr4
+; @brief        Return the contents of the CR4 control register.
+; @reg[out]     rax     The contents of CR4.
+;-----------------------------------------------------------------------------
+get_cr4:
+
+    mov     rax,    cr4
+    ret
+
+;-----------------------------------------------------------------------------
+; @function     set_cr4
+; @brief        Update the CR4 control register.
+; @reg[in]      rdi     The new contents of CR4.
+;-----------------------------------------------------------------------------
+set_cr4:
+
+    mov     cr4,    rdi
+    ret
+
+;-----------------------------------------------------------------------------
+; @function     rdtsc
+; @brief        Read the CPU's time-stamp counter.
+; @reg[out]     rax     The number of cycles elapsed since the CPU was reset.
+;-----------------------------------------------------------------------------
+rdtsc:
+
+    rdtsc
+
+    shl     rdx,    32
+    or      rax,    rdx
+    ret
+
+;-----------------------------------------------------------------------------
+; @function     get_pagefault_addr
+; @brief        Return the virtual address that caused the last page fault.
+; @reg[out]     rax     The contents of the CR2 register.
+;-----------------------------------------------------------------------------
+get_pagefault_addr:
+
+    mov     rax,    cr2
+    ret
+
+;-----------------------------------------------------------------------------
+; @function     cpu_index
+; @brief        Return the index of the CPU executing the caller.
+; @reg[out]     rax     The CPU index (always 0 until APs are started).
+;-----------------------------------------------------------------------------
+cpu_index:
+
+    xor     eax,    eax
+    ret
+
 ;-----------------------------------------------------------------------------
 ; @function     enable_interrupts
 ; @brief        Enable interrupts.
@@ -0,0 +1,29 @@
+//============================================================================
+/// @file       memcmp.c
+/// @brief      Compare one memory region to another.
+//
+// Copyright 2016 Brett Vickers.
+// Use of this source code is governed by a BSD-style license that can
+// be found in the MonkOS LICENSE file.
+//============================================================================
+
+#include <core.h>
+
+int
+memcmp(const void *ptr1, const void *ptr2, size_t num)
+{
+    const uint8_t *p1 = (const uint8_t *)ptr1;
+    const uint8_t *p2 = (const uint8_t *)ptr2;
+
+    // Compare a quadword at a time until the first difference.
+    size_t i = 0;
+    for (; i + 8 <= num; i += 8) {
+        if (*(const uint64_t *)(p1 + i) != *(const uint64_t *)(p2 + i))
+            break;
+    }
+    for (; i < num; i++) {
+        if (p1[i] != p2[i])
+            return (int)p1[i] - (int)p2[i];
+    }
+    return 0;
+}